@@ -8,11 +8,60 @@
 
 #define	TX_NEXT			(5000000 + CNET_rand()%5000000)
 
+//  GPSR NEIGHBOURS BEACON THEIR POSITIONS, AND ARE FORGOTTEN IF NOT HEARD
+#define	BEACON_PERIOD		1000000
+#define	BEACON_NEXT		(BEACON_PERIOD - BEACON_PERIOD/8 + CNET_rand()%(BEACON_PERIOD/4))
+#define	NEIGHBOUR_TIMEOUT	(3*BEACON_PERIOD)
+#define	MAX_NEIGHBOURS		64
+
+//  CONTENTION FORWARDING WAITS UP TO CBF_MAX_DELAY, SCALED BY REMAINING DISTANCE
+#define	CBF_MAX_DELAY		100000
+#define	MAX_CONTENTIONS		16
+
+//  EVERY NODE REMEMBERS THE (src, seqno) OF FRAMES IT HAS DELIVERED OR FORWARDED
+//  IN A SMALL HASHED CACHE, 4 ENTRIES PER BUCKET, FORGOTTEN AFTER SEEN_LIFETIME
+#define	SEEN_BUCKETS		32
+#define	SEEN_WAYS		4
+#define	SEEN_LIFETIME		30000000
+
+//  NO FRAME IS FORWARDED MORE THAN THIS MANY TIMES
+#define	MAX_HOPS		16
+
+//  WITHOUT THE POSITION ORACLE, NODES LEARN WHERE OTHERS ARE FROM THE BEACONS
+//  AND FRAMES THEY HEAR, AND FORGET ANY POSITION OLDER THAN LOCATION_TIMEOUT
+#define	LOCATION_TIMEOUT	20000000
+#define	LOCATION_SHARE		8	// others' positions gossiped in each beacon
+
+//  SELECTED WITH  var routing = "gpsr"  OR  "cbf"  IN THE TOPOLOGY FILE
+typedef enum { ROUTE_ORIGINAL, ROUTE_GPSR, ROUTE_CBF } ROUTING;
+
+//  SELECTED WITH  var locations = "beacons"  IN THE TOPOLOGY FILE
+typedef enum { LOCATE_ORACLE, LOCATE_BEACONS } LOCATING;
+
+typedef enum { KIND_DATA, KIND_BEACON } KIND;
+typedef enum { GREEDY, PERIMETER } GPSR_MODE;
+
 typedef struct {
     int			dest;
     int			src;
     CnetPosition	prevpos;	// position of previous node
     int			length;		// length of payload
+    KIND		kind;		// data, or a neighbour beacon
+    int			prevhop;	// node that transmitted this frame
+    int			seqno;		// per-source sequence number
+    int			hoplimit;	// forwards remaining before the frame is dropped
+    CnetPosition	srcpos;		// where the source was when it sent this frame
+    CnetTime		srcpos_at;
+    CnetPosition	destpos;	// where the destination is believed to be
+    CnetTime		destpos_at;	// when it was there (0 if unknown)
+
+//  ONLY USED BY GPSR
+    int			nexthop;	// the only neighbour that should forward
+    GPSR_MODE		mode;
+    CnetPosition	perimpos;	// where perimeter mode was entered (Lp)
+    CnetPosition	facepos;	// where the current face was entered (Lf)
+    int			edgefrom;	// first edge taken on the current face (e0)
+    int			edgeto;
 } WLAN_HEADER;
 
 typedef struct {
@@ -20,11 +69,474 @@ typedef struct {
     char		payload[2304];
 } WLAN_FRAME;
 
+typedef struct {
+    int			node;
+    CnetPosition	pos;
+    CnetTime		heard;		// when we last heard from this neighbour
+} NEIGHBOUR;
+
+//  A FRAME WE'RE CONTENDING TO FORWARD, OR HAVE ALREADY DEALT WITH
+typedef enum { CBF_FREE, CBF_WAITING, CBF_DONE } CBF_STATE;
+
+typedef struct {
+    CBF_STATE		state;
+    CnetTimerID		timer;
+    CnetTime		when;		// when this entry was last used
+    WLAN_FRAME		frame;
+} CONTENTION;
+
+typedef struct {
+    int			src;
+    int			seqno;
+    CnetTime		when;		// 0 if this entry is empty
+} SEEN;
+
+//  WHERE A NODE WAS, AND WHEN - ALSO THE PAYLOAD OF A BEACON'S GOSSIP
+typedef struct {
+    int			node;
+    CnetPosition	pos;
+    CnetTime		at;		// 0 if we've never heard
+} LOCATION;
+
+//  INDICES INTO THE SHARED stats SEGMENT
+#define	STAT_GENERATED		0
+#define	STAT_RECEIVED		1
+#define	STAT_TRANSMISSIONS	2	// data frames sent, including by the source
+#define	STAT_BEACONS		3
+#define	STAT_UNROUTABLE		4	// GPSR frames dropped with no way forward
+#define	STAT_SUPPRESSED		5	// CBF forwards cancelled by a better-placed node
+#define	STAT_DUPLICATES		6	// frames ignored because they had been seen before
+#define	STAT_HOPLIMIT		7	// frames dropped with no hops left
+#define	STAT_NOLOCATION		8	// frames not sent, the destination's position unknown
+#define	STAT_CONTROL_BYTES	9	// bytes of beacons (gossip included), and of the positions each data frame carries
+#define	NSTATS			10
+
 static	int		*stats		= NULL;
 static	CnetPosition	*positions	= NULL;
 
 static	bool		verbose		= true;
 
+static	ROUTING		routing		= ROUTE_ORIGINAL;
+static	NEIGHBOUR	neighbours[MAX_NEIGHBOURS];
+static	int		nneighbours	= 0;
+static	CONTENTION	contentions[MAX_CONTENTIONS];
+static	int		next_seqno	= 1;
+static	SEEN		seen[SEEN_BUCKETS][SEEN_WAYS];
+static	LOCATING	locating	= LOCATE_ORACLE;
+static	LOCATION	*locations	= NULL;	// NNODES entries, indexed by node
+static	int		next_share	= 0;	// where the next beacon's gossip starts
+
+/* ----------------------------------------------------------------------- */
+
+//  DETERMINE 2D-DISTANCE BETWEEN TWO POSITIONS
+static double distance(CnetPosition p0, CnetPosition p1)
+{
+    int	dx	= p1.x - p0.x;
+    int	dy	= p1.y - p0.y;
+
+    return sqrt(dx*dx + dy*dy);
+}
+
+//  SQUARED DISTANCE, FOR COMPARISONS
+static double distance2(CnetPosition p0, CnetPosition p1)
+{
+    double	dx	= p1.x - p0.x;
+    double	dy	= p1.y - p0.y;
+
+    return dx*dx + dy*dy;
+}
+
+//  ANGLE OF THE LINE FROM ONE POSITION TO ANOTHER, IN RADIANS
+static double bearing(CnetPosition from, CnetPosition to)
+{
+    return atan2(to.y - from.y, to.x - from.x);
+}
+
+/* ------------------------ SEEN-CACHE AND HOP LIMIT ---------------------- */
+
+//  HAVE WE SEEN THIS FRAME RECENTLY?  IF NOT, REMEMBER IT NOW
+//  A NEW ENTRY REPLACES THE OLDEST IN ITS BUCKET (EMPTY AND EXPIRED ENTRIES ARE OLDEST)
+static bool seen_before(WLAN_HEADER *h)
+{
+    SEEN	*bucket	= seen[(unsigned)(h->src * 31 + h->seqno) % SEEN_BUCKETS];
+    SEEN	*victim	= &bucket[0];
+    CnetTime	now	= nodeinfo.time_in_usec;
+
+    for(int w=0 ; w<SEEN_WAYS ; ++w) {
+	if(bucket[w].when != 0 && now - bucket[w].when <= SEEN_LIFETIME &&
+	   bucket[w].src == h->src && bucket[w].seqno == h->seqno) {
+	    ++stats[STAT_DUPLICATES];
+	    return true;
+	}
+	if(bucket[w].when < victim->when)
+	    victim	= &bucket[w];
+    }
+    victim->src	= h->src;
+    victim->seqno	= h->seqno;
+    victim->when	= (now == 0) ? 1 : now;
+    return false;
+}
+
+//  EACH FORWARD USES UP ONE HOP; A FRAME WITH NONE LEFT GOES NO FURTHER
+static bool hop_allowed(WLAN_HEADER *h)
+{
+    if(h->hoplimit <= 0) {
+	++stats[STAT_HOPLIMIT];
+	if(verbose)
+	    fprintf(stdout, "\t\thop limit reached, dropped\n");
+	return false;
+    }
+    --h->hoplimit;
+    return true;
+}
+
+/* --------------------------- LOCATION SERVICE -------------------------- */
+
+//  REMEMBER WHERE A NODE WAS AT A GIVEN TIME, UNLESS WE ALREADY KNOW BETTER
+static void learn_location(int node, CnetPosition pos, CnetTime at)
+{
+    if(locating == LOCATE_ORACLE || at == 0 ||
+       node < 0 || node >= NNODES || node == nodeinfo.nodenumber)
+	return;
+    if(at > locations[node].at) {
+	locations[node].node	= node;
+	locations[node].pos	= pos;
+	locations[node].at	= at;
+    }
+}
+
+//  WHERE IS node?  THE ORACLE ALWAYS KNOWS, OTHERWISE WE MAY HAVE HEARD RECENTLY
+static bool locate(int node, CnetPosition *pos, CnetTime *at)
+{
+    if(locating == LOCATE_ORACLE || node == nodeinfo.nodenumber) {
+	*pos	= positions[node];
+	*at	= nodeinfo.time_in_usec;
+	return true;
+    }
+    if(locations[node].at == 0 ||
+       nodeinfo.time_in_usec - locations[node].at > LOCATION_TIMEOUT)
+	return false;
+    *pos	= locations[node].pos;
+    *at	= locations[node].at;
+    return true;
+}
+
+//  USE OUR OWN IDEA OF WHERE THE DESTINATION IS IF IT'S FRESHER THAN THE FRAME'S
+//  RETURNS false IF NEITHER WE NOR ANYONE BEFORE US KNEW
+static bool refresh_destination(WLAN_HEADER *h)
+{
+    CnetPosition	pos;
+    CnetTime	at;
+
+    if(locate(h->dest, &pos, &at) && at > h->destpos_at) {
+	h->destpos	= pos;
+	h->destpos_at	= at;
+    }
+    return h->destpos_at != 0;
+}
+
+//  GOSSIP SOME OF WHAT WE KNOW, A DIFFERENT SLICE OF OUR TABLE EACH TIME
+static int share_locations(LOCATION *out)
+{
+    int	n	= 0;
+
+    for(int tries=0 ; tries<NNODES && n<LOCATION_SHARE ; ++tries) {
+	int	node	= next_share;
+
+	next_share	= (next_share+1) % NNODES;
+	if(node != nodeinfo.nodenumber && locate(node, &out[n].pos, &out[n].at))
+	    out[n++].node	= node;
+    }
+    return n;
+}
+
+//  EVERY DATA FRAME SENT ALSO CARRIES ITS SOURCE'S AND DESTINATION'S POSITIONS
+static void count_data_frame(void)
+{
+    ++stats[STAT_TRANSMISSIONS];
+    stats[STAT_CONTROL_BYTES]	+= 2*sizeof(CnetPosition) + 2*sizeof(CnetTime);
+}
+
+/* ------------------------- GPSR NEIGHBOUR TABLE ------------------------ */
+
+static void update_neighbour(int node, CnetPosition pos)
+{
+    int	n;
+
+    for(n=0 ; n<nneighbours ; ++n)
+	if(neighbours[n].node == node)
+	    break;
+    if(n == nneighbours) {
+	if(nneighbours == MAX_NEIGHBOURS)
+	    return;
+	++nneighbours;
+    }
+    neighbours[n].node	= node;
+    neighbours[n].pos	= pos;
+    neighbours[n].heard	= nodeinfo.time_in_usec;
+}
+
+static void purge_neighbours(void)
+{
+    for(int n=0 ; n<nneighbours ; )
+	if(nodeinfo.time_in_usec - neighbours[n].heard > NEIGHBOUR_TIMEOUT)
+	    neighbours[n]	= neighbours[--nneighbours];
+	else
+	    ++n;
+}
+
+static EVENT_HANDLER(beacon)
+{
+    WLAN_FRAME	frame;
+    int		link	= 1;
+
+    memset(&frame.header, 0, sizeof(WLAN_HEADER));
+    frame.header.kind		= KIND_BEACON;
+    frame.header.src		= nodeinfo.nodenumber;
+    frame.header.dest		= -1;
+    frame.header.prevhop	= nodeinfo.nodenumber;
+    frame.header.prevpos	= positions[nodeinfo.nodenumber];	// me!
+
+//  WITHOUT THE ORACLE, ALSO PASS ON SOME OF THE POSITIONS WE'VE LEARNT
+    if(locating == LOCATE_BEACONS) {
+	LOCATION	shared[LOCATION_SHARE];
+
+	frame.header.length	= share_locations(shared) * sizeof(LOCATION);
+	memcpy(frame.payload, shared, frame.header.length);
+    }
+
+    size_t len	= sizeof(WLAN_HEADER) + frame.header.length;
+    CHECK(CNET_write_physical_reliable(link, &frame, &len));
+    ++stats[STAT_BEACONS];
+    stats[STAT_CONTROL_BYTES]	+= len;
+
+    CNET_start_timer(EV_TIMER2, BEACON_NEXT, 0);
+}
+
+/* ------------------------ GPSR GREEDY / PERIMETER ----------------------- */
+
+//  IS THE EDGE me--them PART OF THE GABRIEL GRAPH OF OUR NEIGHBOURHOOD?
+//  IT IS UNLESS ANOTHER NEIGHBOUR LIES WITHIN THE CIRCLE WHOSE DIAMETER IS THE EDGE
+static bool gabriel_edge(CnetPosition me, int them)
+{
+    double	uv	= distance2(me, neighbours[them].pos);
+
+    for(int w=0 ; w<nneighbours ; ++w)
+	if(w != them &&
+	   distance2(me, neighbours[w].pos) +
+	   distance2(neighbours[them].pos, neighbours[w].pos) < uv)
+	    return false;
+    return true;
+}
+
+//  RIGHT-HAND RULE: THE FIRST PLANAR EDGE COUNTER-CLOCKWISE FROM ref
+//  AN EDGE EXACTLY ALONG ref (BACK WHERE WE CAME FROM) IS THE LAST CHOICE
+static int right_hand_neighbour(CnetPosition me, double ref)
+{
+    int	best	= -1;
+    double	bestdelta	= 3*M_PI;
+
+    for(int n=0 ; n<nneighbours ; ++n) {
+	if(!gabriel_edge(me, n))
+	    continue;
+	double	delta	= bearing(me, neighbours[n].pos) - ref;
+	while(delta <= 0)
+	    delta	+= 2*M_PI;
+	while(delta > 2*M_PI)
+	    delta	-= 2*M_PI;
+	if(delta < bestdelta) {
+	    bestdelta	= delta;
+	    best	= n;
+	}
+    }
+    return best;
+}
+
+//  DO THE SEGMENTS a--b AND c--d CROSS?  IF SO, WHERE?
+static bool crossing(CnetPosition a, CnetPosition b,
+		     CnetPosition c, CnetPosition d, CnetPosition *at)
+{
+    double	rx	= b.x - a.x,  ry = b.y - a.y;
+    double	sx	= d.x - c.x,  sy = d.y - c.y;
+    double	denom	= rx*sy - ry*sx;
+
+    if(denom == 0)				// parallel
+	return false;
+    double	t	= ((c.x - a.x)*sy - (c.y - a.y)*sx) / denom;
+    double	u	= ((c.x - a.x)*ry - (c.y - a.y)*rx) / denom;
+
+    if(t <= 0 || t >= 1 || u <= 0 || u >= 1)
+	return false;
+    at->x	= a.x + t*rx;
+    at->y	= a.y + t*ry;
+    at->z	= 0;
+    return true;
+}
+
+//  PASS A FRAME TO ITS NEXT HOP, OR DROP IT IF THERE'S NO WAY FORWARD
+static void gpsr_forward(WLAN_FRAME *frame)
+{
+    WLAN_HEADER	*h	= &frame->header;
+    CnetPosition	me	= positions[nodeinfo.nodenumber];
+    int		next	= -1;
+
+    purge_neighbours();
+
+//  PERIMETER MODE ENDS AS SOON AS WE'RE CLOSER THAN WHERE IT BEGAN
+    if(h->mode == PERIMETER && distance2(me, h->destpos) < distance2(h->perimpos, h->destpos))
+	h->mode	= GREEDY;
+
+//  GREEDY: THE SINGLE NEIGHBOUR THAT MAKES THE MOST PROGRESS
+    if(h->mode == GREEDY) {
+	double	best	= distance2(me, h->destpos);
+
+	for(int n=0 ; n<nneighbours ; ++n)
+	    if(distance2(neighbours[n].pos, h->destpos) < best) {
+		best	= distance2(neighbours[n].pos, h->destpos);
+		next	= n;
+	    }
+
+//  NO NEIGHBOUR IS CLOSER - A LOCAL MINIMUM, SO START ROUTING AROUND THE FACE
+	if(next == -1) {
+	    next	= right_hand_neighbour(me, bearing(me, h->destpos));
+	    if(next != -1) {
+		h->mode		= PERIMETER;
+		h->perimpos	= me;
+		h->facepos	= me;
+		h->edgefrom	= nodeinfo.nodenumber;
+		h->edgeto	= neighbours[next].node;
+	    }
+	}
+    }
+
+//  PERIMETER: FOLLOW THE RIGHT-HAND RULE FROM THE EDGE WE ARRIVED ON
+    else {
+	bool	newface	= false;
+
+	next	= right_hand_neighbour(me, bearing(me, h->prevpos));
+
+//  IF THIS EDGE CROSSES Lp--D CLOSER TO D, CHANGE TO THE NEXT FACE
+	for(int tries=0 ; next != -1 && tries<nneighbours ; ++tries) {
+	    CnetPosition	at;
+
+	    if(!crossing(me, neighbours[next].pos, h->perimpos, h->destpos, &at) ||
+	       distance2(at, h->destpos) >= distance2(h->facepos, h->destpos))
+		break;
+	    h->facepos	= at;
+	    next	= right_hand_neighbour(me, bearing(me, neighbours[next].pos));
+	    newface	= true;
+	}
+	if(next != -1) {
+	    if(newface) {
+		h->edgefrom	= nodeinfo.nodenumber;
+		h->edgeto	= neighbours[next].node;
+	    }
+//  ABOUT TO TAKE THIS FACE'S FIRST EDGE AGAIN - THE DESTINATION IS UNREACHABLE
+	    else if(h->edgefrom == nodeinfo.nodenumber && h->edgeto == neighbours[next].node)
+		next	= -1;
+	}
+    }
+
+    if(next == -1) {
+	++stats[STAT_UNROUTABLE];
+	if(verbose)
+	    fprintf(stdout, "\t\tno route to %d, dropped\n", h->dest);
+	return;
+    }
+
+    h->nexthop	= neighbours[next].node;
+    h->prevhop	= nodeinfo.nodenumber;
+    h->prevpos	= me;
+    size_t len	= sizeof(WLAN_HEADER) + h->length;
+    CHECK(CNET_write_physical_reliable(1, frame, &len));
+    count_data_frame();
+
+    if(verbose)
+	fprintf(stdout, "\t\t%s to %d\n",
+			h->mode == GREEDY ? "greedy" : "perimeter", h->nexthop);
+}
+
+/* ----------------------- CONTENTION-BASED FORWARDING ------------------- */
+
+//  FIND OUR ENTRY FOR A FRAME, OR (IF create) RECYCLE THE OLDEST FINISHED ONE
+static CONTENTION *contention_for(WLAN_HEADER *h, bool create)
+{
+    CONTENTION	*oldest	= NULL;
+
+    for(int c=0 ; c<MAX_CONTENTIONS ; ++c) {
+	CONTENTION	*entry	= &contentions[c];
+
+	if(entry->state != CBF_FREE &&
+	   entry->frame.header.src == h->src && entry->frame.header.seqno == h->seqno)
+	    return entry;
+	if(entry->state != CBF_WAITING && (oldest == NULL || entry->when < oldest->when))
+	    oldest	= entry;
+    }
+    if(!create || oldest == NULL)
+	return NULL;
+    oldest->state	= CBF_FREE;
+    oldest->when	= nodeinfo.time_in_usec;
+    return oldest;
+}
+
+//  OUR BACKOFF EXPIRED WITHOUT HEARING A BETTER-PLACED NODE - WE'RE THE RELAY
+static EVENT_HANDLER(contention_expired)
+{
+    CONTENTION	*entry	= &contentions[(int)data];
+    WLAN_HEADER	*h	= &entry->frame.header;
+
+    if(entry->state != CBF_WAITING)
+	return;
+    entry->state	= CBF_DONE;
+    h->prevpos	= positions[nodeinfo.nodenumber];	// me!
+    h->prevhop	= nodeinfo.nodenumber;
+
+    size_t len	= sizeof(WLAN_HEADER) + h->length;
+    CHECK(CNET_write_physical_reliable(1, &entry->frame, &len));
+    count_data_frame();
+    if(verbose)
+	fprintf(stdout, "\t%5s: contention won, forwarding\n", nodeinfo.nodename);
+}
+
+//  EVERY NODE CLOSER TO THE DESTINATION THAN THE SENDER CONTENDS TO FORWARD,
+//  WAITING LONGER THE FURTHER IT STILL IS.  HEARING A NODE CLOSER THAN US
+//  FORWARD THE SAME FRAME FIRST MEANS WE CAN STAND DOWN.
+static void cbf_receive(WLAN_FRAME *frame)
+{
+    WLAN_HEADER	*h	= &frame->header;
+
+    refresh_destination(h);
+    CnetPosition	dest	= h->destpos;
+    double		prev	= distance(h->prevpos, dest);
+    double		now	= distance(positions[nodeinfo.nodenumber], dest);
+    CONTENTION	*entry	= contention_for(h, false);
+
+    if(entry != NULL) {
+	if(entry->state == CBF_WAITING && prev < now) {
+	    CNET_stop_timer(entry->timer);
+	    entry->state	= CBF_DONE;
+	    ++stats[STAT_SUPPRESSED];
+	    if(verbose)
+		fprintf(stdout, "\t\tbetter relay heard, standing down\n");
+	}
+	return;
+    }
+    if(now >= prev)				// not closer, so not a candidate
+	return;
+    if(seen_before(h))			// its entry may have been recycled since we forwarded it
+	return;
+    if(!hop_allowed(h))
+	return;
+
+    entry	= contention_for(h, true);
+    if(entry == NULL)			// every entry is still waiting
+	return;
+    entry->frame	= *frame;
+    entry->state	= CBF_WAITING;
+    entry->timer	= CNET_start_timer(EV_TIMER3,
+			(CnetTime)(CBF_MAX_DELAY * now / prev), (CnetData)(entry - contentions));
+}
+
 /* ----------------------------------------------------------------------- */
 
 static EVENT_HANDLER(transmit)
@@ -33,36 +545,49 @@ static EVENT_HANDLER(transmit)
     int		link	= 1;
 
 //  POPULATE A NEW FRAME
+    memset(&frame.header, 0, sizeof(WLAN_HEADER));
     do {
 	frame.header.dest	= CNET_rand() % NNODES;
     } while(frame.header.dest == nodeinfo.nodenumber);
     frame.header.src		= nodeinfo.nodenumber;
     frame.header.prevpos	= positions[nodeinfo.nodenumber];	// me!
+    frame.header.prevhop	= nodeinfo.nodenumber;
+    frame.header.kind		= KIND_DATA;
+    frame.header.seqno		= next_seqno++;
+    frame.header.hoplimit	= MAX_HOPS;
+    frame.header.srcpos		= positions[nodeinfo.nodenumber];	// me!
+    frame.header.srcpos_at	= nodeinfo.time_in_usec;
 
     sprintf(frame.payload, "hello from %d", nodeinfo.nodenumber);
     frame.header.length	= strlen(frame.payload) + 1;	// send nul-byte too
-
-//  TRANSMIT THE FRAME
-    size_t len	= sizeof(WLAN_HEADER) + frame.header.length;
-    CHECK(CNET_write_physical_reliable(link, &frame, &len));
-    ++stats[0];
+    ++stats[STAT_GENERATED];
 
     if(verbose) {
 	fprintf(stdout, "\n%s: transmitting '%s' to %d\n",
 			nodeinfo.nodename, frame.payload, frame.header.dest);
     }
 
-//  SCHEDULE OUR NEXT TRANSMISSION
-    CNET_start_timer(EV_TIMER1, TX_NEXT, 0);
-}
+//  WE CAN'T ROUTE TOWARDS A DESTINATION WHOSE POSITION WE DON'T KNOW
+    if(!refresh_destination(&frame.header)) {
+	++stats[STAT_NOLOCATION];
+	if(verbose)
+	    fprintf(stdout, "\t\tno location for %d, dropped\n", frame.header.dest);
+    }
 
-//  DETERMINE 2D-DISTANCE BETWEEN TWO POSITIONS
-static double distance(CnetPosition p0, CnetPosition p1)
-{
-    int	dx	= p1.x - p0.x;
-    int	dy	= p1.y - p0.y;
+//  GPSR CHOOSES A SINGLE NEXT HOP TOWARDS THE DESTINATION'S POSITION
+    else if(routing == ROUTE_GPSR) {
+	frame.header.mode	= GREEDY;
+	gpsr_forward(&frame);
+    }
+//  TRANSMIT THE FRAME
+    else {
+	size_t len	= sizeof(WLAN_HEADER) + frame.header.length;
+	CHECK(CNET_write_physical_reliable(link, &frame, &len));
+	count_data_frame();
+    }
 
-    return sqrt(dx*dx + dy*dy);
+//  SCHEDULE OUR NEXT TRANSMISSION
+    CNET_start_timer(EV_TIMER1, TX_NEXT, 0);
 }
 
 static EVENT_HANDLER(receive)
@@ -74,6 +599,29 @@ static EVENT_HANDLER(receive)
 //  READ THE ARRIVING FRAME FROM OUR PHYSICAL LINK
     len	= sizeof(frame);
     CHECK(CNET_read_physical(&link, &frame, &len));
+
+//  EVERY FRAME TELLS US WHERE ITS SENDER IS
+    learn_location(frame.header.prevhop, frame.header.prevpos, nodeinfo.time_in_usec);
+    if(routing == ROUTE_GPSR)
+	update_neighbour(frame.header.prevhop, frame.header.prevpos);
+
+//  A BEACON MAY ALSO CARRY WHERE OTHER NODES HAVE BEEN
+    if(frame.header.kind == KIND_BEACON) {
+	LOCATION	shared[LOCATION_SHARE];
+	int		nshared	= frame.header.length / sizeof(LOCATION);
+
+	if(nshared > LOCATION_SHARE)
+	    nshared	= LOCATION_SHARE;
+	memcpy(shared, frame.payload, nshared * sizeof(LOCATION));
+	for(int n=0 ; n<nshared ; ++n)
+	    learn_location(shared[n].node, shared[n].pos, shared[n].at);
+	return;
+    }
+
+//  AND A DATA FRAME, WHERE ITS SOURCE WAS AND WHERE ITS DESTINATION IS THOUGHT TO BE
+    learn_location(frame.header.src, frame.header.srcpos, frame.header.srcpos_at);
+    learn_location(frame.header.dest, frame.header.destpos, frame.header.destpos_at);
+
     if(verbose) {
 	double	rx_signal;
 	CHECK(CNET_wlan_arrival(link, &rx_signal, NULL));
@@ -83,21 +631,38 @@ static EVENT_HANDLER(receive)
 
 //  IS THIS FRAME FOR ME?
     if(frame.header.dest == nodeinfo.nodenumber) {
-	++stats[1];
+	if(seen_before(&frame.header))	// only count the first copy
+	    return;
+	++stats[STAT_RECEIVED];
 	if(verbose)
 	    fprintf(stdout, "\t\tfor me!\n");
     }
 
+//  NO; WITH GPSR, FORWARD ONLY IF WE WERE CHOSEN AS THE NEXT HOP
+//  (NOT THE SEEN-CACHE: A PERIMETER WALK MAY RIGHTLY PASS THROUGH US TWICE)
+    else if(routing == ROUTE_GPSR) {
+	if(frame.header.nexthop == nodeinfo.nodenumber && hop_allowed(&frame.header))
+	    gpsr_forward(&frame);
+    }
+
+//  NO; WITH CONTENTION FORWARDING, BACK OFF AND SEE IF ANYONE BETTER FORWARDS
+    else if(routing == ROUTE_CBF)
+	cbf_receive(&frame);
+
 //  NO; RETRANSMIT FRAME IF WE'RE CLOSER TO THE DESTINATION THAN THE PREV NODE
     else {
-	CnetPosition	dest	= positions[frame.header.dest];
+	refresh_destination(&frame.header);
+
+	CnetPosition	dest	= frame.header.destpos;
 	double		prev	= distance(frame.header.prevpos, dest);
 	double		now	= distance(positions[nodeinfo.nodenumber],dest);
 
-	if(now < prev) {	// closer?
+	if(now < prev && !seen_before(&frame.header) && hop_allowed(&frame.header)) {	// closer?
 	    frame.header.prevpos = positions[nodeinfo.nodenumber]; // me!
+	    frame.header.prevhop = nodeinfo.nodenumber;
 	    len			 = sizeof(WLAN_HEADER) + frame.header.length;
 	    CHECK(CNET_write_physical_reliable(link, &frame, &len));
+	    count_data_frame();
 	    if(verbose)
 		fprintf(stdout, "\t\tretransmitting\n");
 	}
@@ -107,15 +672,25 @@ static EVENT_HANDLER(receive)
 //  THIS FUNCTION IS CALLED ONCE, ON TERMINATION, TO REPORT OUR STATISTICS
 static EVENT_HANDLER(finished)
 {
-    fprintf(stdout, "messages generated:\t%d\n", stats[0]);
-    fprintf(stdout, "messages received:\t%d\n", stats[1]);
-    if(stats[0] > 0)
-	fprintf(stdout, "delivery ratio:\t\t%.1f%%\n", 100.0*stats[1]/stats[0]);
+    fprintf(stdout, "messages generated:\t%d\n", stats[STAT_GENERATED]);
+    fprintf(stdout, "messages received:\t%d\n", stats[STAT_RECEIVED]);
+    if(stats[STAT_GENERATED] > 0)
+	fprintf(stdout, "delivery ratio:\t\t%.1f%%\n", 100.0*stats[STAT_RECEIVED]/stats[STAT_GENERATED]);
+    if(stats[STAT_RECEIVED] > 0)
+	fprintf(stdout, "tx per delivered:\t%.2f\n", (double)stats[STAT_TRANSMISSIONS]/stats[STAT_RECEIVED]);
+    fprintf(stdout, "beacons sent:\t\t%d\n", stats[STAT_BEACONS]);
+    fprintf(stdout, "control bytes:\t\t%d\n", stats[STAT_CONTROL_BYTES]);
+    fprintf(stdout, "no location:\t\t%d\n", stats[STAT_NOLOCATION]);
+    fprintf(stdout, "unroutable:\t\t%d\n", stats[STAT_UNROUTABLE]);
+    fprintf(stdout, "relays suppressed:\t%d\n", stats[STAT_SUPPRESSED]);
+    fprintf(stdout, "duplicates ignored:\t%d\n", stats[STAT_DUPLICATES]);
+    fprintf(stdout, "hop limit drops:\t%d\n", stats[STAT_HOPLIMIT]);
 }
 
 EVENT_HANDLER(reboot_node)
 {
     extern void init_mobility(double walkspeed_m_per_sec, int pausetime_secs);
+    extern void init_wlan_model(void);
 
     if(NNODES == 0) {
 	fprintf(stderr, "simulation must be invoked with the -N switch\n");
@@ -126,17 +701,42 @@ EVENT_HANDLER(reboot_node)
     CNET_check_version(CNET_VERSION);
     CNET_srand(time(NULL) + nodeinfo.nodenumber);
 
-//  INITIALIZE MOBILITY PARAMETERS
+//  INITIALIZE MOBILITY PARAMETERS, AND OUR PROPAGATION MODEL IF ONE'S CHOSEN
     init_mobility(WALKING_SPEED, PAUSE_TIME);
+    init_wlan_model();
 
 //  ALLOCATE MEMORY FOR SHARED MEMORY SEGMENTS
-    stats	= CNET_shmem2("s", 2*sizeof(int));
+    stats	= CNET_shmem2("s", NSTATS*sizeof(int));
     positions	= CNET_shmem2("p", NNODES*sizeof(CnetPosition));
 
+//  WHICH ROUTING SCHEME ARE WE USING?
+    char	*scheme	= CNET_getvar("routing");
+    if(scheme != NULL && strcmp(scheme, "gpsr") == 0)
+	routing	= ROUTE_GPSR;
+    else if(scheme != NULL && strcmp(scheme, "cbf") == 0)
+	routing	= ROUTE_CBF;
+
+//  DO WE KNOW WHERE EVERYONE IS, OR ONLY WHAT WE HEAR?
+    char	*where	= CNET_getvar("locations");
+    if(where != NULL && strcmp(where, "beacons") == 0) {
+	locating	= LOCATE_BEACONS;
+	locations	= calloc(NNODES, sizeof(LOCATION));
+    }
+
 //  PREPARE FOR OUR MESSAGE GENERATION AND TRANSMISSION
     CHECK(CNET_set_handler(EV_TIMER1, transmit, 0));
     CNET_start_timer(EV_TIMER1, TX_NEXT, 0);
 
+//  GPSR NODES, AND ALL NODES WITHOUT THE ORACLE, BEACON THEIR POSITION TO THEIR NEIGHBOURS
+    if(routing == ROUTE_GPSR || locating == LOCATE_BEACONS) {
+	CHECK(CNET_set_handler(EV_TIMER2, beacon, 0));
+	CNET_start_timer(EV_TIMER2, BEACON_NEXT, 0);
+    }
+
+//  CBF NODES NEED NO BEACONS, JUST A TIMER FOR EACH CONTENTION
+    if(routing == ROUTE_CBF)
+	CHECK(CNET_set_handler(EV_TIMER3, contention_expired, 0));
+
 //  SET HANDLERS FOR EVENTS FROM THE PHYSICAL LAYER
     CHECK(CNET_set_handler(EV_PHYSICALREADY,  receive, 0));
 
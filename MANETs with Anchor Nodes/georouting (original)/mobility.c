@@ -35,8 +35,8 @@ static	CnetPosition	*positions	= NULL;
 
 static void random_point(POINT *new)
 {
-    new->x = CNET_nextrand(walk->mt) % (walk->maparea.x-2*MARGIN) + MARGIN;
-    new->y = CNET_nextrand(walk->mt) % (walk->maparea.y-2*MARGIN) + MARGIN;
+    new->x = CNET_nextrand(walk->mt) % (long)(walk->maparea.x-2*MARGIN) + MARGIN;
+    new->y = CNET_nextrand(walk->mt) % (long)(walk->maparea.y-2*MARGIN) + MARGIN;
 }
 
 static EVENT_HANDLER(mobility)
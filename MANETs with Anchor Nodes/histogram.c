@@ -0,0 +1,110 @@
+#include <cnet.h>
+#include <cnetsupport.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "lab3.h"
+
+//  LOG-BUCKETED HISTOGRAMS, KEPT IN ONE SHARED MEMORY SEGMENT SO THAT EVERY
+//  NODE ADDS TO THE SAME ONES.  VALUES 0..3 HAVE A BUCKET EACH; ABOVE THAT EACH
+//  POWER OF TWO IS SPLIT INTO 4 BUCKETS, SO A PERCENTILE IS WITHIN ~12% OF THE
+//  TRUE VALUE.
+
+#define	SUB_BUCKETS		4
+#define	HIST_BUCKETS		(SUB_BUCKETS * 62)
+
+typedef struct {
+    int64_t		count;
+    int64_t		min;
+    int64_t		max;
+    double		sum;
+    int64_t		buckets[HIST_BUCKETS];
+} HISTOGRAM;
+
+static	HISTOGRAM	*histograms	= NULL;
+
+// -----------------------------------------------------------------------
+
+static int bucket_of(int64_t value)
+{
+    if(value < SUB_BUCKETS) {
+        return value < 0 ? 0 : (int)value;
+    }
+    int	octave	= 63 - __builtin_clzll((uint64_t)value);	// floor(log2(value)), >= 2
+
+    return SUB_BUCKETS*(octave-1) + (int)((value >> (octave-2)) & (SUB_BUCKETS-1));
+}
+
+//  THE SMALLEST VALUE THAT FALLS IN A BUCKET
+static int64_t bucket_floor(int b)
+{
+    if(b < SUB_BUCKETS) {
+        return b;
+    }
+    int	octave	= b/SUB_BUCKETS + 1;
+
+    return (int64_t)(SUB_BUCKETS + b%SUB_BUCKETS) << (octave-2);
+}
+
+//  EVERY NODE CALLS THIS ONCE, WITH THE SAME n
+void init_histograms(int n)
+{
+    histograms	= CNET_shmem2("h", n*sizeof(HISTOGRAM));
+}
+
+void histogram_add(int which, int64_t value)
+{
+    HISTOGRAM	*h	= &histograms[which];
+
+    if(h->count == 0 || value < h->min) {
+        h->min	= value;
+    }
+    if(h->count == 0 || value > h->max) {
+        h->max	= value;
+    }
+    ++h->count;
+    h->sum	+= value;
+    ++h->buckets[bucket_of(value)];
+}
+
+//  THE VALUE BELOW WHICH pct PERCENT OF VALUES FALL - THE MIDDLE OF ITS BUCKET
+int64_t histogram_percentile(int which, double pct)
+{
+    HISTOGRAM	*h	= &histograms[which];
+    int64_t	wanted	= (int64_t)(pct/100.0 * h->count + 0.5);
+    int64_t	seen	= 0;
+
+    if(h->count == 0) {
+        return 0;
+    }
+    if(wanted < 1) {
+        wanted	= 1;
+    }
+    for(int b=0 ; b<HIST_BUCKETS ; ++b) {
+        seen	+= h->buckets[b];
+        if(seen >= wanted) {
+            int64_t	top	= (b+1 < HIST_BUCKETS) ? bucket_floor(b+1) - 1 : h->max;
+            int64_t	mid	= bucket_floor(b) + (top - bucket_floor(b)) / 2;
+
+            return mid < h->min ? h->min : mid > h->max ? h->max : mid;
+        }
+    }
+    return h->max;
+}
+
+//  ONE LINE OF SUMMARY, WITH VALUES DIVIDED BY scale (E.G. 1000000 FOR SECONDS)
+void histogram_print(int which, const char *title, double scale, const char *units)
+{
+    HISTOGRAM	*h	= &histograms[which];
+
+    if(h->count == 0) {
+        fprintf(stdout, "%-20s\t(none)\n", title);
+        return;
+    }
+    fprintf(stdout, "%-20s\tn=%lld mean=%.3f p50=%.3f p90=%.3f p99=%.3f max=%.3f %s\n",
+            title, (long long)h->count, h->sum / h->count / scale,
+            histogram_percentile(which, 50) / scale,
+            histogram_percentile(which, 90) / scale,
+            histogram_percentile(which, 99) / scale,
+            h->max / scale, units);
+}
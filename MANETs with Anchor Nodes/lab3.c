@@ -1,7 +1,10 @@
 #include <cnet.h>
 #include <cnetsupport.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <time.h>
+#include "lab3.h"
 
 /************************************************************
 *   Routing in MANETs with Anchor Nodes                     *
@@ -25,8 +28,14 @@
 // If an anchor is within this distance, we will forward the message to the anchor
 #define FORWARDING_DISTANCE 50
 
-// Randomly generated time period to send next frame (for mobiles)
-#define	TX_NEXT			(5000000 + CNET_rand()%5000000)
+// How many times a mobile's message may be relayed by other mobiles on its way to an anchor
+#define RELAY_HOP_LIMIT     1
+
+// Randomly generated time period before a mobile may ask an anchor for data again
+#define	ASK_NEXT		(5000000 + CNET_rand()%5000000)
+
+// Anchors beacon on every multiple of BEACON_PERIOD
+#define BEACON_PERIOD       1000000
 
 // Header for a frame
 typedef struct {
@@ -34,8 +43,19 @@ typedef struct {
     int			    src;
     CnetPosition	srcpos;	        // position of the source
     int			    length;		    // length of payload
-    bool            retransmitted;  // true if frame has been retransmitted once
+    int             seqno;          // per-source sequence number of this message
+    int             hoplimit;       // mobile relays this frame may still take (0 = no more)
+    int             hops;           // transmissions this message has taken so far, including the source's
+    int             copies;         // spray-and-wait copies the receiver may still hand out
+    CnetTime        created;        // when the source generated this message
+    CnetTime        custody_since;  // when an anchor first stored this message (kept as it's handed between anchors)
+    int             from_anchor;    // the anchor that sent this copy from its store (-1 if none did)
+    bool            retransmitted;  // true if frame has been relayed by a mobile
     bool            anchor_request; // true if we are requesting data from anchor
+    bool            aggregate;      // true if the payload is a batch of complete frames (header + payload each)
+    bool            anchor_ack;     // true if the payload lists MESSAGE_IDs we have received from an anchor
+    bool            backbone;       // true if sent anchor-to-anchor over the backbone (CNET_write_direct)
+    bool            dtn_summary;    // true if the payload lists the MESSAGE_IDs a mobile carries (delay-tolerant routing)
 } WLAN_HEADER;
 
 // Frame containing a header and payload
@@ -44,231 +64,1921 @@ typedef struct {
     char		payload[2304];
 } WLAN_FRAME;
 
-// Shared memory variables for global statistics
-static	int		        *stats		= NULL;
+// Identifies one message, as listed in the payload of an anchor_ack frame
+typedef struct {
+    int             src;
+    int             seqno;
+} MESSAGE_ID;
+
+// Where a mobile is walking to, sent as the payload of its download requests
+typedef struct {
+    CnetPosition    dest;           // the waypoint it's walking to
+    double          speed;          // metres per second, 0 if paused
+} MOVEMENT;
+
+// Where and when an anchor last heard from a mobile, and where it was heading
+// Shared between anchors as the payload of a backbone frame
+typedef struct {
+    int             address;        // the mobile (0 if never heard)
+    CnetPosition    pos;            // its position when it was heard
+    CnetTime        heard_at;       // when it was heard
+    MOVEMENT        movement;       // where it was heading (speed 0 if paused)
+    bool            heading_known;  // false unless movement came from one of its download requests
+} SIGHTING;
+
+// Shared memory variables for global statistics
+static	int		        *stats		= NULL;
+
+// Shared count of the nodes that have shut down, so the last one prints the statistics
+static	int		        *nodes_finished	= NULL;
+
+// Indices into the shared stats segment
+#define STAT_GENERATED      0       // unique messages generated by mobiles
+#define STAT_RECEIVED       1       // unique messages received by their destination
+#define STAT_DUPLICATES     2       // extra copies discarded by a destination
+#define STAT_REQUESTS       3       // download requests sent to anchors
+#define STAT_REQUESTS_SKIPPED 4     // beacons ignored because they advertised nothing for us
+#define STAT_REPLY_FRAMES   5       // frames transmitted by anchors in download replies
+#define STAT_REPLY_MESSAGES 6       // messages carried by those frames
+#define STAT_REPLY_BYTES    7       // bytes transmitted in download replies, headers included
+#define STAT_CUSTODY_ACKED  8       // stored frames released because the mobile acknowledged them
+#define STAT_CUSTODY_EXPIRED 9      // stored frames dropped because their lifetime ran out
+#define STAT_CUSTODY_REFUSED 10     // relayed frames dropped because the anchor's buffer was full
+#define STAT_HANDOFFS       11      // stored frames another anchor accepted over the backbone
+#define STAT_SIGHTINGS_SHARED 12    // sightings sent to other anchors over the backbone
+#define STAT_PUSHES         13      // download replies an anchor sent without being asked
+#define STAT_HOPLIMIT       14      // frames a mobile would have relayed, but for their hop limit
+#define STAT_REDUCED_POWER  15      // frames sent at less than full power, because their receiver was close
+#define STAT_RELAYS         16      // frames relayed by mobiles
+#define STAT_RELAYS_SUPPRESSED 17   // relays cancelled because enough other copies were overheard first
+#define STAT_RELAYS_HEARD   18      // relayed frames an anchor took into its store (each anchor counts a message once)
+#define STAT_TRANSMISSIONS  19      // frames of any kind written to the WLAN, by anchors and mobiles
+#define STAT_DTN_FORWARDED  20      // messages handed from one mobile to another by delay-tolerant routing
+#define STAT_DTN_DROPPED    21      // messages dropped from a mobile's full buffer
+#define STAT_HANDOFFS_REFUSED 22    // stored frames another anchor had no room for, so we kept them
+#define STAT_DTN_EXPIRED    23      // messages a mobile gave up carrying because their lifetime ran out
+#define STAT_RELAYS_SEEN    24      // overheard frames not relayed because we'd already heard that message
+#define NSTATS              25
+
+// Histograms kept (in shared memory) by histogram.c, and printed when the simulation ends
+#define HIST_DELAY          0       // microseconds from generation to first delivery
+#define HIST_HOPS           1       // transmissions each delivered message took
+#define HIST_RESIDENCY      2       // microseconds a frame spent in one anchor's store
+#define HIST_OCCUPANCY      3       // frames in an anchor's store, sampled at each anchor beacon
+#define NHISTOGRAMS         4
+
+// Defined further down, but needed earlier
+static void request_from_anchor(int anchor_address_to_request_from);
+static void dtn_originate(WLAN_FRAME *frame);
+
+// Set to false if you don't want details and stuff printed...?
+static	bool		    verbose		= true;
+
+// An array containing mobile and anchor addresses
+// We can store a maximum of 100 addresses
+int mobile_addresses[100];
+int anchor_addresses[100];
+
+// Number of mobile and anchor nodes
+int mobile_count;
+int anchor_count;
+
+// A frame to be forwarded to a mobile when requested, and when it was stored
+// Used only for anchor nodes, which keep them in store.c named by a handle
+// Only the header and header.length bytes of payload are kept, so a short message takes a short chunk
+typedef struct {
+    CnetTime        stored_at;
+    CnetTime        offered_at;     // when we last offered it to another anchor (0 if never)
+    WLAN_FRAME      frame;
+} STORED_FRAME;
+#define STORED_LENGTH(length)   (offsetof(STORED_FRAME, frame) + sizeof(WLAN_HEADER) + (length))
+
+// The most memory an anchor's store may take, unless var anchorstore says otherwise
+// The same as 20 full-sized frames took when each one was kept whole
+#define ANCHOR_STORE_BYTES  (20 * sizeof(WLAN_FRAME))
+
+// In custody-transfer mode, anchors keep each frame until its destination acknowledges it
+// Set with 'var custody = "1"' in the topology file
+bool custody_transfer;
+
+// How long an anchor holds a frame before giving up on its destination (usecs)
+#define CUSTODY_LIFETIME    120000000
+
+// Registry of where each mobile was last heard, indexed the same way as mobile_addresses
+// Used only by anchors, to hand stored frames to the anchor closest to their destination
+SIGHTING mobile_registry[100];
+
+// When we last told the other anchors about each mobile, and how often we're willing to
+CnetTime registry_shared_at[100];
+#define SIGHTING_SHARE_INTERVAL 5000000
+
+// Predicted window during which each mobile will be in range of this anchor, and when we last sent it anything
+// Indexed the same way as mobile_addresses; a window with contact_end <= contact_start is empty
+CnetTime contact_start[100];
+CnetTime contact_end[100];
+CnetTime replied_at[100];
+
+// A mobile within CONTACT_RANGE metres of an anchor is assumed to hear it
+// Predictions are trusted for PREDICTION_HORIZON after a sighting, and pushes repeat at most every PUSH_INTERVAL
+#define CONTACT_RANGE       100.0
+#define PREDICTION_HORIZON  30000000
+#define PUSH_INTERVAL       2000000
+
+// A new sighting this close to where the previous heading predicted keeps that heading
+#define ON_COURSE_DISTANCE  10.0
+
+// Positions of the other anchors, indexed the same way as anchor_addresses
+// Learnt from their announcements over the backbone
+CnetPosition peer_anchor_positions[100];
+bool peer_anchor_known[100];
+bool announced;
+
+// A list of anchor locations, and the address of the anchor at each location
+// Used only by mobiles
+#define MAX_KNOWN_ANCHORS   1000
+CnetPosition anchor_locations[MAX_KNOWN_ANCHORS];
+int anchor_location_addresses[MAX_KNOWN_ANCHORS];
+int anchor_locations_count;
+
+// Uniform grid over the map that indexes anchor_locations by position
+// Each cell holds the head of a linked list of indices into anchor_locations (-1 if empty)
+// Cells are FORWARDING_DISTANCE wide, so a relay decision only looks at the 3x3 cells around us
+#define GRID_CELL_SIZE      FORWARDING_DISTANCE
+int *anchor_grid;
+int anchor_grid_next[MAX_KNOWN_ANCHORS];
+int grid_cols;
+int grid_rows;
+
+// Bool that controls if mobiles can ask anchors for data
+bool can_i_ask;
+
+// With var selection = "rssi", a mobile keeps a smoothed signal strength for the anchors whose beacons it hears
+// It then relays only if one of them is heard well enough to expect the relay to arrive (instead of within FORWARDING_DISTANCE)
+// And it asks the strongest of the anchors whose beacons advertise something for it, rather than the first
+#define MAX_HEARD_ANCHORS   8
+#define RSSI_SMOOTHING      0.25                    // weight of each new sample
+#define RSSI_FRESH          (3 * BEACON_PERIOD)     // older estimates are ignored
+#define RSSI_MARGIN         3.0                     // dB above what a receiver needs, before we rely on a link
+#define NO_SIGNAL           (-1000.0)
+#define REQUEST_WAIT        30000                   // how long to listen for other beacons before asking
+typedef struct {
+    int             index;          // into anchor_locations, -1 if unused
+    double          rssi_dBm;
+    CnetTime        heard_at;
+} HEARD_ANCHOR;
+HEARD_ANCHOR heard_anchors[MAX_HEARD_ANCHORS];
+bool rssi_selection;
+int best_advertiser;                // the index of the strongest anchor to ask, while we wait (-1 if none)
+
+// Bloom filter of the destinations an anchor has buffered frames for
+// It is the payload of every anchor beacon, so mobiles only request when something is probably waiting
+#define BLOOM_BITS          256
+#define BLOOM_HASHES        3
+typedef struct {
+    uint8_t         bits[BLOOM_BITS/8];
+} PENDING_SUMMARY;
+
+// Sequence number to stamp on the next message this mobile generates
+// Starts at 1, so a zero seqno never names a real message
+int next_seqno;
+
+// Sliding window of the sequence numbers recently seen from one source
+// Anything older than DUP_WINDOW_SIZE behind the highest seqno is treated as a duplicate
+#define DUP_WINDOW_SIZE     64
+typedef struct {
+    int             highest;        // highest seqno seen so far (0 if none)
+    uint64_t        bitmap;         // bit i is set if seqno (highest - i) has been seen
+} DUP_WINDOW;
+
+// One window per source mobile, indexed the same way as mobile_addresses
+// Used by anchors, before storing, which hear a source's messages to every destination and so in order
+DUP_WINDOW dup_windows[100];
+
+// A bounded set of recently seen (src, seqno) pairs, each remembered for at most a given lifetime
+// Once it's full, the oldest pair makes way for the newest, so its memory is fixed however busy the network
+#define SEEN_SLOTS          512
+typedef struct {
+    MESSAGE_ID      ids[SEEN_SLOTS];
+    CnetTime        seen_at[SEEN_SLOTS];
+    int             next;           // slot the next new pair goes in
+} SEEN_CACHE;
+
+// The messages a mobile has had delivered, used before counting a delivery
+// A destination only hears a source's messages to itself, and an anchor may hold one for CUSTODY_LIFETIME,
+// so it can't use a window: a stored message arrives far behind newer ones that came direct
+// It's remembered for twice that, to allow for the time taken to reach the anchor and then us
+#define DELIVERED_LIFETIME  (2 * (CnetTime)CUSTODY_LIFETIME)
+SEEN_CACHE delivered;
+
+// The messages a mobile has overheard on their way to an anchor, used before relaying one
+// A relay is only any use within moments of the original, so each is remembered for RELAY_SEEN_LIFETIME
+#define RELAY_SEEN_LIFETIME 10000000
+SEEN_CACHE overheard;
+
+// With duty cycling (var dutycycle), a mobile's radio sleeps except for a window around each anchor beacon
+// The window opens DUTY_GUARD before the beacon and lasts DUTY_WINDOW, long enough to request and be answered
+// A mobile also wakes to transmit, and stays awake for TX_AWAKE afterwards
+#define DUTY_GUARD          5000
+#define DUTY_WINDOW         100000
+#define TX_AWAKE            10000
+#define DUTY_WAKE           1
+#define DUTY_SLEEP          2
+bool duty_cycling;
+WLANSTATE radio_state;
+CnetTime radio_state_since;     // when the radio last changed state (or energy was last counted)
+CnetTime awake_until;           // don't sleep before this
+double battery_mAH;             // battery charge when energy was last counted
+
+// Shared totals of the energy used by all mobiles, indices into the 'e' segment
+static	double		        *energy		= NULL;
+#define ENERGY_RADIO_mJ     0       // from the WLANINFO currents and time in each radio state
+#define ENERGY_BATTERY_mJ   1       // drained from the batteries, as cnet reports them
+#define ENERGY_ASLEEP_SECS  2       // radio-seconds spent asleep
+#define ENERGY_AWAKE_SECS   3       // and awake
+#define NENERGY             4
+
+// With power control (var powercontrol), a frame for a receiver whose position we know is sent with just enough power to reach it
+// The model's path loss at that distance is topped up by var linkmargin dB, to allow for movement and shadowing
+// Anything else, including every beacon and every mobile's own message, is still sent at full power
+bool power_control;
+double link_margin_dB;
+double full_power_dBm;          // our radio's tx_power_dBm at reboot
+
+// Delay-tolerant routing between mobiles, chosen with var routing, instead of the anchors
+// "epidemic" hands every message to every mobile met that doesn't already have it
+// "spray" (binary spray-and-wait) gives each new message var copies copies, and hands half of them to each mobile met
+// A mobile down to its last copy waits to meet the destination itself
+// Mobiles meet by hearing each other's hello, a summary vector of the messages they carry and have lately received
+// Each carries at most var dtnbuffer messages in store.c, dropping its oldest to make room
+#define DTN_ANCHORS         0
+#define DTN_EPIDEMIC        1
+#define DTN_SPRAY           2
+#define DTN_RECENT          32      // how many received messages our summary also lists
+#define HELLO_PERIOD        1000000
+int dtn_routing;
+int spray_copies;
+int dtn_buffer;
+MESSAGE_ID dtn_recent[DTN_RECENT];
+int dtn_recent_next;
+
+// A mobile waits a random time of up to RELAY_JITTER before relaying a frame it overheard
+// If it overhears var relaythreshold other copies of the same message meanwhile, it doesn't bother
+// (a threshold of 0 relays at once, whatever else is overheard)
+#define RELAY_JITTER        20000
+#define MAX_PENDING_RELAYS  8
+typedef struct {
+    WLAN_FRAME      frame;
+    size_t          len;
+    int             copies;         // other copies overheard while waiting
+    CnetTimerID     timer;          // NULLTIMER if this slot is free
+} PENDING_RELAY;
+PENDING_RELAY pending_relays[MAX_PENDING_RELAYS];
+int relay_threshold;
+
+
+/*******************************************************************************
+*                              CALCULATE DISTANCE                              *
+*******************************************************************************/
+// Calculates the squared distance between two CnetPositions
+// Compare against a squared range instead of paying for a sqrt
+static double distance_squared(CnetPosition p0, CnetPosition p1)
+{
+    double dx	= p1.x - p0.x;
+    double dy	= p1.y - p0.y;
+
+    return dx*dx + dy*dy;
+}
+
+
+/*******************************************************************************
+*                           KNOWN ANCHOR SPATIAL GRID                          *
+*******************************************************************************/
+// Allocates an empty grid covering the whole map
+static void init_anchor_grid(void)
+{
+    CnetPosition maparea;
+    CHECK(CNET_get_position(NULL, &maparea));
+
+    grid_cols = (int)(maparea.x / GRID_CELL_SIZE) + 1;
+    grid_rows = (int)(maparea.y / GRID_CELL_SIZE) + 1;
+    anchor_grid = realloc(anchor_grid, grid_cols * grid_rows * sizeof(int));
+    for(int i=0 ; i<grid_cols*grid_rows ; i++){
+        anchor_grid[i] = -1;
+    }
+    anchor_locations_count = 0;
+}
+
+// Returns the column and row of the cell containing a position, clamped to the map
+static void grid_cell(CnetPosition pos, int *col, int *row)
+{
+    *col = (int)(pos.x / GRID_CELL_SIZE);
+    *row = (int)(pos.y / GRID_CELL_SIZE);
+    *col = (*col < 0) ? 0 : (*col >= grid_cols) ? grid_cols-1 : *col;
+    *row = (*row < 0) ? 0 : (*row >= grid_rows) ? grid_rows-1 : *row;
+}
+
+// Adds an anchor to the grid, unless we already know about it
+// Only the cell containing the anchor's position is searched
+// Returns its index into anchor_locations, or -1 if there's no room for it
+static int add_known_anchor(int address, CnetPosition pos)
+{
+    int col, row;
+    grid_cell(pos, &col, &row);
+
+    for(int i=anchor_grid[row*grid_cols + col] ; i != -1 ; i=anchor_grid_next[i]){
+        if(anchor_location_addresses[i] == address){
+            return i;
+        }
+    }
+    if(anchor_locations_count == MAX_KNOWN_ANCHORS){
+        return -1;
+    }
+
+    int index = anchor_locations_count++;
+    anchor_locations[index] = pos;
+    anchor_location_addresses[index] = address;
+    anchor_grid_next[index] = anchor_grid[row*grid_cols + col];
+    anchor_grid[row*grid_cols + col] = index;
+    return index;
+}
+
+// Returns the index (into anchor_locations) of the closest known anchor within radius of pos, or -1
+// Only the cells overlapping the radius are searched
+static int nearest_known_anchor(CnetPosition pos, double radius)
+{
+    int col, row;
+    grid_cell(pos, &col, &row);
+    int reach = (int)ceil(radius / GRID_CELL_SIZE);
+
+    int best = -1;
+    double best_d2 = radius * radius;
+    for(int r=row-reach ; r<=row+reach ; r++){
+        if(r < 0 || r >= grid_rows){
+            continue;
+        }
+        for(int c=col-reach ; c<=col+reach ; c++){
+            if(c < 0 || c >= grid_cols){
+                continue;
+            }
+            for(int i=anchor_grid[r*grid_cols + c] ; i != -1 ; i=anchor_grid_next[i]){
+                double d2 = distance_squared(anchor_locations[i], pos);
+                if(d2 < best_d2){
+                    best_d2 = d2;
+                    best = i;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+
+/*******************************************************************************
+*                              INITIALIZE A HEADER                             *
+*******************************************************************************/
+// Fills in a header from this node to dest, stamped with our current position
+// Every flag starts false and there is no payload, so callers only set what's special about their frame
+static void new_header(WLAN_HEADER *header, int dest)
+{
+    // A mobile's position is only worked out when it's needed, and it's needed now
+    mobility_update();
+
+    memset(header, 0, sizeof(WLAN_HEADER));
+    header->dest = dest;
+    header->src = nodeinfo.address;
+    header->from_anchor = -1;
+    CHECK(CNET_get_position(&header->srcpos, NULL));
+}
+
+
+/*******************************************************************************
+*                              DUPLICATE SUPPRESSION                           *
+*******************************************************************************/
+// Returns the index of a mobile's address in mobile_addresses, or -1 if unknown
+static int mobile_index(int address)
+{
+    for(int i=0 ; i<mobile_count ; i++){
+        if(mobile_addresses[i] == address){
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Returns true if (src, seqno) has been seen before, otherwise records it and returns false
+static bool is_duplicate(int src, int seqno)
+{
+    int index = mobile_index(src);
+    if(index < 0 || seqno <= 0){
+        return false;
+    }
+    DUP_WINDOW *window = &dup_windows[index];
+
+    // A newer message slides the window forward
+    if(seqno > window->highest){
+        int shift = seqno - window->highest;
+        window->bitmap = (shift >= DUP_WINDOW_SIZE) ? 1 : (window->bitmap << shift) | 1;
+        window->highest = seqno;
+        return false;
+    }
+
+    // An older message is a duplicate if its bit is set, or if it fell out of the window
+    int offset = window->highest - seqno;
+    if(offset >= DUP_WINDOW_SIZE || (window->bitmap & ((uint64_t)1 << offset))){
+        return true;
+    }
+    window->bitmap |= ((uint64_t)1 << offset);
+    return false;
+}
+
+// Returns true if (src, seqno) is in the cache and was seen within lifetime, otherwise records it and returns false
+// Anything the cache has forgotten is taken as new, so a late copy is never lost for being late
+static bool seen_before(SEEN_CACHE *cache, int src, int seqno, CnetTime lifetime)
+{
+    for(int i=0 ; i<SEEN_SLOTS ; i++){
+        if(cache->ids[i].src == src && cache->ids[i].seqno == seqno && nodeinfo.time_in_usec - cache->seen_at[i] <= lifetime){
+            return true;
+        }
+    }
+    cache->ids[cache->next].src = src;
+    cache->ids[cache->next].seqno = seqno;
+    cache->seen_at[cache->next] = nodeinfo.time_in_usec;
+    cache->next = (cache->next + 1) % SEEN_SLOTS;
+    return false;
+}
+
+// Returns the handle of the frame we're storing for (src, seqno), or -1 if we aren't
+// Anchors use it for handed-over frames, and mobiles for the messages they carry
+static int find_stored(int src, int seqno)
+{
+    for(int h=store_next(-1) ; h != -1 ; h=store_next(h)){
+        STORED_FRAME *s = store_get(h);
+        if(s->frame.header.src == src && s->frame.header.seqno == seqno){
+            return h;
+        }
+    }
+    return -1;
+}
+
+
+/*******************************************************************************
+*                            PENDING DATA BLOOM FILTER                         *
+*******************************************************************************/
+// Returns the i'th bit position for an address, using double hashing
+static int bloom_bit(int address, int i)
+{
+    uint32_t h1 = (uint32_t)address * 2654435761u;
+    uint32_t h2 = ((uint32_t)address * 40503u) | 1;
+
+    return (h1 + i*h2) % BLOOM_BITS;
+}
+
+// Marks an address as (probably) having pending frames
+static void bloom_add(PENDING_SUMMARY *summary, int address)
+{
+    for(int i=0 ; i<BLOOM_HASHES ; i++){
+        int bit = bloom_bit(address, i);
+        summary->bits[bit/8] |= (1 << (bit%8));
+    }
+}
+
+// Returns false if the address definitely has no pending frames, true if it probably does
+static bool bloom_may_contain(const PENDING_SUMMARY *summary, int address)
+{
+    for(int i=0 ; i<BLOOM_HASHES ; i++){
+        int bit = bloom_bit(address, i);
+        if((summary->bits[bit/8] & (1 << (bit%8))) == 0){
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*******************************************************************************
+*                       ANCHOR SIGNAL STRENGTH (mobile)                        *
+*******************************************************************************/
+// Folds the strength of a beacon just heard into that anchor's estimate
+// Beacons always go at full power, so they're a fair measure of the link (relays go at full power too, unless power control knows better)
+// An anchor we haven't heard lately replaces the one heard least recently
+static void heard_anchor(int index, double rssi_dBm)
+{
+    HEARD_ANCHOR *stalest = &heard_anchors[0];
+
+    for(int i=0 ; i<MAX_HEARD_ANCHORS ; i++){
+        HEARD_ANCHOR *heard = &heard_anchors[i];
+
+        if(heard->index == index){
+            if(nodeinfo.time_in_usec - heard->heard_at > RSSI_FRESH){
+                heard->rssi_dBm = rssi_dBm;
+            }
+            else{
+                heard->rssi_dBm += RSSI_SMOOTHING * (rssi_dBm - heard->rssi_dBm);
+            }
+            heard->heard_at = nodeinfo.time_in_usec;
+            return;
+        }
+        if(heard->heard_at < stalest->heard_at){
+            stalest = heard;
+        }
+    }
+    stalest->index = index;
+    stalest->rssi_dBm = rssi_dBm;
+    stalest->heard_at = nodeinfo.time_in_usec;
+}
+
+// Returns the smoothed strength of an anchor's signal, or NO_SIGNAL if we haven't heard it lately
+static double anchor_rssi(int index)
+{
+    for(int i=0 ; i<MAX_HEARD_ANCHORS ; i++){
+        HEARD_ANCHOR *heard = &heard_anchors[i];
+
+        if(heard->index == index && index >= 0 && nodeinfo.time_in_usec - heard->heard_at <= RSSI_FRESH){
+            return heard->rssi_dBm;
+        }
+    }
+    return NO_SIGNAL;
+}
+
+// Returns the index (into anchor_locations) of the anchor to relay towards, or -1 if we shouldn't relay
+// By signal strength, it's the strongest anchor heard lately, if it's strong enough to expect our relay to get there
+static int relay_anchor(CnetPosition pos)
+{
+    if(!rssi_selection){
+        return nearest_known_anchor(pos, FORWARDING_DISTANCE);
+    }
+
+    WLANINFO info;
+    CHECK(CNET_get_wlaninfo(1, &info));
+    double needed = info.rx_sensitivity_dBm + info.rx_signal_to_noise_dBm + RSSI_MARGIN;
+
+    int best = -1;
+    double best_rssi = needed;
+    for(int i=0 ; i<MAX_HEARD_ANCHORS ; i++){
+        double rssi = anchor_rssi(heard_anchors[i].index);
+        if(rssi >= best_rssi){
+            best_rssi = rssi;
+            best = heard_anchors[i].index;
+        }
+    }
+    return best;
+}
+
+// Our wait for other beacons is over, so ask the strongest anchor that has something for us
+static EVENT_HANDLER(ask_best_advertiser)
+{
+    if(best_advertiser >= 0){
+        request_from_anchor(anchor_location_addresses[best_advertiser]);
+        best_advertiser = -1;
+    }
+}
+
+// A beacon from the anchor at index advertises something for us
+// By signal strength, we wait REQUEST_WAIT for other anchors' beacons and then ask the strongest
+static void anchor_advertised(int index, int address)
+{
+    if(!rssi_selection || index < 0){
+        if(can_i_ask == true){
+            can_i_ask = false;
+            request_from_anchor(address);
+        }
+        return;
+    }
+    if(can_i_ask == true){
+        can_i_ask = false;
+        best_advertiser = index;
+        CNET_start_timer(EV_TIMER7, REQUEST_WAIT, 0);
+    }
+    else if(best_advertiser >= 0 && anchor_rssi(index) > anchor_rssi(best_advertiser)){
+        best_advertiser = index;
+    }
+}
+
+// We haven't heard any anchors yet
+static void init_anchor_rssi(void)
+{
+    char *selection = CNET_getvar("selection");
+
+    rssi_selection = (selection == NULL || strcmp(selection, "distance") != 0);
+    for(int i=0 ; i<MAX_HEARD_ANCHORS ; i++){
+        heard_anchors[i].index = -1;
+        heard_anchors[i].heard_at = 0;
+    }
+    best_advertiser = -1;
+    CHECK(CNET_set_handler(EV_TIMER7, ask_best_advertiser, 0));
+}
+
+
+/*******************************************************************************
+*                            TRANSMIT POWER CONTROL                            *
+*******************************************************************************/
+// Sets our transmit power to reach a receiver metres away (negative if we don't know), and returns it
+// The path loss comes from the propagation model in use (wlanmodel.c), and the receiver's radio is assumed to be the same as ours
+static double set_tx_power(int link, double metres)
+{
+    WLANINFO info;
+    double power = full_power_dBm;
+
+    CHECK(CNET_get_wlaninfo(link, &info));
+    if(power_control && metres >= 0.0){
+        // The weakest signal the receiver can decode, plus our margin, plus everything lost on the way
+        double needed = info.rx_sensitivity_dBm + info.rx_signal_to_noise_dBm + link_margin_dB +
+                        wlan_path_loss(metres, info.frequency_GHz) +
+                        info.tx_cable_loss_dBm - info.tx_antenna_gain_dBi -
+                        info.rx_antenna_gain_dBi + info.rx_cable_loss_dBm;
+        if(needed < full_power_dBm){
+            power = needed;
+            ++stats[STAT_REDUCED_POWER];
+        }
+    }
+    if(power != info.tx_power_dBm){
+        info.tx_power_dBm = power;
+        CHECK(CNET_set_wlaninfo(link, &info));
+    }
+    return power;
+}
+
+// Returns how far we are from a known anchor, or -1 if we don't know where it is
+// The anchor is almost always one we've just heard, so the grid is searched in rings of cells outwards from ours
+static double known_anchor_distance(int address)
+{
+    CnetPosition here;
+    CHECK(CNET_get_position(&here, NULL));
+    int col, row;
+    grid_cell(here, &col, &row);
+
+    int rings = (grid_cols > grid_rows) ? grid_cols : grid_rows;
+    for(int reach=0 ; reach<rings ; reach++){
+        for(int r=row-reach ; r<=row+reach ; r++){
+            if(r < 0 || r >= grid_rows){
+                continue;
+            }
+            // Only the cells on this ring; the inner ones have been searched already
+            int step = (r == row-reach || r == row+reach) ? 1 : 2*reach;
+            for(int c=col-reach ; c<=col+reach ; c+=step){
+                if(c < 0 || c >= grid_cols){
+                    continue;
+                }
+                for(int i=anchor_grid[r*grid_cols + c] ; i != -1 ; i=anchor_grid_next[i]){
+                    if(anchor_location_addresses[i] == address){
+                        return sqrt(distance_squared(anchor_locations[i], here));
+                    }
+                }
+            }
+        }
+    }
+    return -1.0;
+}
+
+// Every node starts at its radio's default power
+static void init_power_control(void)
+{
+    WLANINFO info;
+
+    CHECK(CNET_get_wlaninfo(1, &info));
+    full_power_dBm = info.tx_power_dBm;
+    power_control = getvar_int("powercontrol", 0) != 0;
+    link_margin_dB = getvar_double("linkmargin", 6.0);
+}
+
+
+/*******************************************************************************
+*                    MOBILE RADIO, DUTY CYCLING AND ENERGY                     *
+*******************************************************************************/
+// Adds the energy used since we last counted to the shared totals
+// The radio's own model charges sleep_current_mA or idle_current_mA for the whole time
+// (transmissions are added in physical_write, and receptions in count_reception)
+static void count_energy(void)
+{
+    WLANINFO info;
+    double volts, mAH;
+    double secs = (nodeinfo.time_in_usec - radio_state_since) / 1000000.0;
+
+    CHECK(CNET_get_wlaninfo(1, &info));
+    CHECK(CNET_get_battery(&volts, &mAH));
+
+    double mA = (radio_state == WLAN_SLEEP) ? info.sleep_current_mA : info.idle_current_mA;
+    energy[ENERGY_RADIO_mJ] += mA * volts * secs;
+    energy[ENERGY_BATTERY_mJ] += (battery_mAH - mAH) * volts * 3600.0;
+    energy[(radio_state == WLAN_SLEEP) ? ENERGY_ASLEEP_SECS : ENERGY_AWAKE_SECS] += secs;
+
+    battery_mAH = mAH;
+    radio_state_since = nodeinfo.time_in_usec;
+}
+
+// Puts our radio to sleep, or wakes it, counting the energy used in the state it's leaving
+static void set_radio(WLANSTATE state)
+{
+    count_energy();
+    if(state != radio_state){
+        CHECK(CNET_set_wlanstate(1, state));
+        radio_state = state;
+    }
+}
+
+// The MAC layer (mac.c) calls this when the medium is free for one of our frames
+// metres is how far away the frame's receiver is (negative if unknown), for power control
+// A mobile's transmission costs tx_current_mA (over idle) for as long as the frame takes to send
+// At reduced power that extra current is scaled down with the power radiated
+static void physical_write(int link, void *frame, size_t len, double metres)
+{
+    double power = set_tx_power(link, metres);
+    CHECK(CNET_write_physical_reliable(link, frame, &len));
+    ++stats[STAT_TRANSMISSIONS];
+
+    if(nodeinfo.nodetype != NT_MOBILE){
+        return;
+    }
+    if(duty_cycling && awake_until < nodeinfo.time_in_usec + TX_AWAKE){
+        awake_until = nodeinfo.time_in_usec + TX_AWAKE;
+        CNET_start_timer(EV_TIMER5, TX_AWAKE, DUTY_SLEEP);
+    }
+
+    WLANINFO info;
+    double volts, mAH;
+    CHECK(CNET_get_wlaninfo(link, &info));
+    CHECK(CNET_get_battery(&volts, &mAH));
+    double secs = (len * 8.0) / linkinfo[link].bandwidth;
+    double fraction = pow(10.0, (power - full_power_dBm) / 10.0);
+    energy[ENERGY_RADIO_mJ] += (info.tx_current_mA - info.idle_current_mA) * fraction * volts * secs;
+}
+
+// A mobile's reception costs rx_current_mA (over idle) for as long as the frame took to arrive
+static void count_reception(int link, size_t len)
+{
+    WLANINFO info;
+    double volts, mAH;
+    CHECK(CNET_get_wlaninfo(link, &info));
+    CHECK(CNET_get_battery(&volts, &mAH));
+    double secs = (len * 8.0) / linkinfo[link].bandwidth;
+    energy[ENERGY_RADIO_mJ] += (info.rx_current_mA - info.idle_current_mA) * volts * secs;
+}
+
+// Every frame a mobile sends goes through here, so a sleeping radio is woken first
+// The frame then waits in the MAC layer's queue, and the radio stays awake until it has gone
+static void radio_write(int link, WLAN_FRAME *frame, size_t *len, double metres)
+{
+    if(radio_state == WLAN_SLEEP){
+        set_radio(WLAN_IDLE);
+    }
+    mac_write(link, frame, *len, metres);
+}
+
+// DUTY_WAKE opens the window before each beacon, and schedules the next one
+// DUTY_SLEEP closes it, unless we're still busy transmitting or have frames waiting to go
+// Without duty cycling, the radio stays idle and this just counts energy once per beacon period
+static EVENT_HANDLER(duty_cycle)
+{
+    if(data == DUTY_WAKE){
+        CNET_start_timer(EV_TIMER5, BEACON_PERIOD, DUTY_WAKE);
+        if(duty_cycling){
+            set_radio(WLAN_IDLE);
+            awake_until = nodeinfo.time_in_usec + DUTY_WINDOW;
+            CNET_start_timer(EV_TIMER5, DUTY_WINDOW, DUTY_SLEEP);
+        }
+        else{
+            count_energy();
+        }
+    }
+    else if(nodeinfo.time_in_usec >= awake_until && !mac_busy()){
+        set_radio(WLAN_SLEEP);
+    }
+}
+
+// Starts counting energy from now, and (with duty cycling) waking before the next beacon
+static void init_radio(void)
+{
+    double volts;
+
+    duty_cycling = getvar_int("dutycycle", 0) != 0;
+    radio_state = WLAN_IDLE;
+    radio_state_since = nodeinfo.time_in_usec;
+    awake_until = 0;
+    CHECK(CNET_get_battery(&volts, &battery_mAH));
+
+    CnetTime phase = nodeinfo.time_in_usec % BEACON_PERIOD;
+    CnetTime first_wake = BEACON_PERIOD - DUTY_GUARD - phase;
+    if(phase > BEACON_PERIOD - DUTY_GUARD){
+        first_wake += BEACON_PERIOD;
+    }
+    CHECK(CNET_set_handler(EV_TIMER5, duty_cycle, 0));
+    CNET_start_timer(EV_TIMER5, first_wake, DUTY_WAKE);
+    if(duty_cycling){
+        set_radio(WLAN_SLEEP);
+    }
+}
+
+
+/*******************************************************************************
+*                                   ASK ANCHOR                                *
+*******************************************************************************/
+// Every 10 seconds, a mobile is allowed to ask an anchor for data
+// This prevents mobiles from continually asking anchors for data when they're nearby
+static EVENT_HANDLER(ask_anchor)
+{
+    can_i_ask = true;
+    CNET_start_timer(EV_TIMER3, ASK_NEXT, 0);
+}
+
+
+/*******************************************************************************
+*                       REQUEST FRAMES FROM NEARBY ANCHOR                      *
+*******************************************************************************/
+static void request_from_anchor(int anchor_address_to_request_from)
+{
+    // Initalize a frame
+    // Send over WLAN link
+    WLAN_FRAME	frame;
+    int	link = 1;
+
+    // The destination is the anchor we want data from
+    new_header(&frame.header, anchor_address_to_request_from);
+    frame.header.anchor_request = true;
+
+    // Tell the anchor where we're heading, so it can predict when we'll be back in range
+    MOVEMENT movement;
+    if(!mobility_heading(&movement.dest, &movement.speed)){
+        movement.dest = frame.header.srcpos;
+        movement.speed = 0.0;
+    }
+    memcpy(frame.payload, &movement, sizeof(movement));
+    frame.header.length	= sizeof(movement);
+
+    // Transmit the frame
+    size_t len = sizeof(WLAN_HEADER) + frame.header.length;
+    radio_write(link, &frame, &len, known_anchor_distance(anchor_address_to_request_from));
+    ++stats[STAT_REQUESTS];
+
+    // Print that the message was sent
+    if(verbose) {
+        fprintf(stdout, "mobile [%3d]: requesting from anchor [%d]\n", nodeinfo.address, anchor_address_to_request_from);
+    }
+
+}
+
+
+/*******************************************************************************
+*                            TRANSMIT FRAME (mobile)                           *
+*******************************************************************************/
+static EVENT_HANDLER(transmit)
+{
+    // Initalize a frame
+    // Send over WLAN link
+    WLAN_FRAME	frame;
+    int	link = 1;
+
+    // The traffic module (traffic.c) decides who to send to, how much, and when
+    // Pick a random destination from the other mobiles, if there are any
+    int dest = traffic_destination();
+    if(dest == 0){
+        CNET_start_timer(EV_TIMER1, traffic_next_interval(), 0);
+        return;
+    }
+
+    // Assign other header values
+    new_header(&frame.header, dest);
+    frame.header.seqno = next_seqno++;
+    frame.header.hoplimit = RELAY_HOP_LIMIT;
+    frame.header.hops = 1;
+    frame.header.created = nodeinfo.time_in_usec;
+
+    // Generate a payload message and its length
+    // A longer payload is padded out after the message, but must still fit in one frame
+    // With delay-tolerant routing it must fit inside another header, to be handed from mobile to mobile
+    sprintf(frame.payload, "hello from %d", nodeinfo.address);
+    frame.header.length	= strlen(frame.payload) + 1;	// send nul-byte too
+
+    int wanted = traffic_payload_length();
+    int room = linkinfo[link].mtu - (int)sizeof(WLAN_HEADER);
+    if(dtn_routing != DTN_ANCHORS){
+        room -= sizeof(WLAN_HEADER);
+    }
+    if(room > (int)sizeof(frame.payload)){
+        room = sizeof(frame.payload);
+    }
+    if(wanted > room){
+        wanted = room;
+    }
+    if(wanted > frame.header.length){
+        memset(frame.payload + frame.header.length, 0, wanted - frame.header.length);
+        frame.header.length = wanted;
+    }
+
+    // With delay-tolerant routing, we just carry it until we meet someone
+    if(dtn_routing != DTN_ANCHORS){
+        dtn_originate(&frame);
+        ++stats[STAT_GENERATED];
+        CNET_start_timer(EV_TIMER1, traffic_next_interval(), 0);
+        return;
+    }
+
+    // Transmit the frame
+    size_t len = sizeof(WLAN_HEADER) + frame.header.length;
+    radio_write(link, &frame, &len, -1.0);
+    ++stats[STAT_GENERATED];
+
+    // Print that the message was sent
+    if(verbose) {
+        fprintf(stdout, "mobile [%3d]: pkt transmitted (src=%d, dest=%d, seq=%d)\n", nodeinfo.address, frame.header.src, frame.header.dest, frame.header.seqno);
+    }
+
+    // SCHEDULE OUR NEXT TRANSMISSION
+    CNET_start_timer(EV_TIMER1, traffic_next_interval(), 0);
+}
+
+
+/*******************************************************************************
+*                            DELIVER FRAME (mobile)                            *
+*******************************************************************************/
+// Called for every frame addressed to this mobile, whether it arrived on its own or inside a batch
+// Only the first copy of each message is counted
+static void deliver(WLAN_HEADER *header)
+{
+    if(seen_before(&delivered, header->src, header->seqno, DELIVERED_LIFETIME)){
+        ++stats[STAT_DUPLICATES];
+        if(verbose){
+            fprintf(stdout, "mobile [%3d]: duplicate discarded (src=%d, dest=%d, seq=%d)\n", nodeinfo.address, header->src, header->dest, header->seqno);
+        }
+    }
+    else{
+        ++stats[STAT_RECEIVED];
+        histogram_add(HIST_DELAY, nodeinfo.time_in_usec - header->created);
+        histogram_add(HIST_HOPS, header->hops);
+        if(verbose){
+            //fprintf(stdout, "\tfor me!\n");
+            fprintf(stdout, "mobile [%3d]: pkt received (src=%d, dest=%d, seq=%d)\n", nodeinfo.address, header->src, header->dest, header->seqno);
+        }
+    }
+}
+
+// Tells the anchors which stored messages we now hold, so they can stop keeping them in custody
+// Any anchor that overhears the acknowledgement releases its copies, not just the one it's addressed to
+static void send_custody_ack(int anchor_address, MESSAGE_ID *ids, int nids)
+{
+    WLAN_FRAME	frame;
+    int	link = 1;
+
+    new_header(&frame.header, anchor_address);
+    frame.header.anchor_ack = true;
+
+    memcpy(frame.payload, ids, nids * sizeof(MESSAGE_ID));
+    frame.header.length = nids * sizeof(MESSAGE_ID);
+
+    size_t len = sizeof(WLAN_HEADER) + frame.header.length;
+    radio_write(link, &frame, &len, known_anchor_distance(anchor_address));
+}
+
+// Splits a batched download reply back into its frames and delivers each one
+// In custody-transfer mode, every frame in the batch is then acknowledged
+static void deliver_aggregate(WLAN_FRAME *frame)
+{
+    MESSAGE_ID ids[sizeof(frame->payload) / sizeof(WLAN_HEADER)];
+    int nids = 0;
+
+    size_t offset = 0;
+    while(offset + sizeof(WLAN_HEADER) <= (size_t)frame->header.length){
+        // Frames are packed back to back, so copy each header out rather than reading it in place
+        WLAN_HEADER header;
+        memcpy(&header, frame->payload + offset, sizeof(WLAN_HEADER));
+        // A frame claiming more payload than the batch has left is corrupt, and so is anything after it
+        if(header.length < 0 || offset + sizeof(WLAN_HEADER) + header.length > (size_t)frame->header.length){
+            break;
+        }
+        deliver(&header);
+        offset += sizeof(WLAN_HEADER) + header.length;
+
+        ids[nids].src = header.src;
+        ids[nids].seqno = header.seqno;
+        nids++;
+    }
+
+    if(custody_transfer == true && nids > 0 && frame->header.src < 100){
+        send_custody_ack(frame->header.src, ids, nids);
+    }
+}
+
+
+/*******************************************************************************
+*                       DELAY-TOLERANT ROUTING (mobile)                        *
+*******************************************************************************/
+// Orders MESSAGE_IDs, so a summary vector can be sorted and then searched
+static int compare_ids(const void *a, const void *b)
+{
+    const MESSAGE_ID *x = a;
+    const MESSAGE_ID *y = b;
+
+    if(x->src != y->src){
+        return (x->src < y->src) ? -1 : 1;
+    }
+    return (x->seqno < y->seqno) ? -1 : (x->seqno > y->seqno);
+}
+
+// Starts carrying a message, unless we already are
+// If our buffer is full, the message we've carried longest makes way for it
+static void dtn_keep(WLAN_FRAME *frame)
+{
+    if(find_stored(frame->header.src, frame->header.seqno) >= 0){
+        return;
+    }
+    while(store_count() >= dtn_buffer){
+        int oldest = -1;
+        CnetTime oldest_at = 0;
+        for(int h=store_next(-1) ; h != -1 ; h=store_next(h)){
+            STORED_FRAME *s = store_get(h);
+            if(oldest < 0 || s->stored_at < oldest_at){
+                oldest = h;
+                oldest_at = s->stored_at;
+            }
+        }
+        store_free(oldest);
+        ++stats[STAT_DTN_DROPPED];
+    }
+
+    int h = store_alloc(STORED_LENGTH(frame->header.length));
+    if(h < 0){
+        ++stats[STAT_DTN_DROPPED];
+        return;
+    }
+    STORED_FRAME *s = store_get(h);
+    s->stored_at = nodeinfo.time_in_usec;
+    memcpy(&s->frame, frame, sizeof(WLAN_HEADER) + frame->header.length);
+}
+
+// A message we've just generated, which nobody has yet
+static void dtn_originate(WLAN_FRAME *frame)
+{
+    frame->header.hops = 0;
+    frame->header.copies = spray_copies;
+    dtn_keep(frame);
+    if(verbose) {
+        fprintf(stdout, "mobile [%3d]: pkt generated (src=%d, dest=%d, seq=%d)\n", nodeinfo.address, frame->header.src, frame->header.dest, frame->header.seqno);
+    }
+}
+
+// Every HELLO_PERIOD (or so, so neighbours don't stay in step) we tell anyone nearby what we have
+// Messages that have outlived CUSTODY_LIFETIME are given up on first
+static EVENT_HANDLER(dtn_hello)
+{
+    WLAN_FRAME	frame;
+    int	link = 1;
+
+    for(int h=store_next(-1) ; h != -1 ; h=store_next(h)){
+        STORED_FRAME *s = store_get(h);
+        if(nodeinfo.time_in_usec - s->stored_at > CUSTODY_LIFETIME){
+            store_free(h);
+            ++stats[STAT_DTN_EXPIRED];
+        }
+    }
+
+    new_header(&frame.header, 1000);
+    frame.header.dtn_summary = true;
+
+    size_t capacity = linkinfo[link].mtu - sizeof(WLAN_HEADER);
+    if(capacity > sizeof(frame.payload)){
+        capacity = sizeof(frame.payload);
+    }
+    MESSAGE_ID *ids = (MESSAGE_ID *)frame.payload;
+    int max_ids = capacity / sizeof(MESSAGE_ID);
+    int nids = 0;
+
+    for(int h=store_next(-1) ; h != -1 && nids < max_ids ; h=store_next(h)){
+        STORED_FRAME *s = store_get(h);
+        ids[nids].src = s->frame.header.src;
+        ids[nids].seqno = s->frame.header.seqno;
+        nids++;
+    }
+    for(int i=0 ; i<DTN_RECENT && nids < max_ids ; i++){
+        if(dtn_recent[i].src != 0){
+            ids[nids++] = dtn_recent[i];
+        }
+    }
+    frame.header.length = nids * sizeof(MESSAGE_ID);
+
+    size_t len = sizeof(WLAN_HEADER) + frame.header.length;
+    radio_write(link, &frame, &len, -1.0);
+
+    CNET_start_timer(EV_TIMER6, HELLO_PERIOD + CNET_rand() % (HELLO_PERIOD / 10), 0);
+}
+
+// We've heard a neighbour's hello, so hand it whatever it doesn't have and should get
+// Messages are packed back to back in as few frames as possible, like an anchor's download reply
+// A message for the neighbour itself is handed over, but kept until its hello lists it (as received)
+// The MAC may drop our batch or lose it in a collision, and spraying, ours may be the last copy
+static void dtn_contact(WLAN_FRAME *hello)
+{
+    int link = 1;
+    int neighbour = hello->header.src;
+
+    MESSAGE_ID *theirs = (MESSAGE_ID *)hello->payload;
+    int ntheirs = hello->header.length / sizeof(MESSAGE_ID);
+    qsort(theirs, ntheirs, sizeof(MESSAGE_ID), compare_ids);
+
+    size_t capacity = linkinfo[link].mtu - sizeof(WLAN_HEADER);
+    if(capacity > sizeof(((WLAN_FRAME *)NULL)->payload)){
+        capacity = sizeof(((WLAN_FRAME *)NULL)->payload);
+    }
+
+    WLAN_FRAME batch;
+    new_header(&batch.header, neighbour);
+    batch.header.aggregate = true;
+    double metres = sqrt(distance_squared(hello->header.srcpos, batch.header.srcpos));
+    int nframes = 0;
+
+    for(int h=store_next(-1) ; h != -1 ; h=store_next(h)){
+        WLAN_FRAME *frame = &((STORED_FRAME *)store_get(h))->frame;
+        MESSAGE_ID id = { frame->header.src, frame->header.seqno };
+        size_t framelen = sizeof(WLAN_HEADER) + frame->header.length;
+
+        if(bsearch(&id, theirs, ntheirs, sizeof(MESSAGE_ID), compare_ids) != NULL){
+            if(frame->header.dest == neighbour){
+                store_free(h);
+            }
+            continue;
+        }
+        if(framelen > capacity){
+            continue;
+        }
+
+        // Spraying, we keep half our copies; with just one, we wait for the destination
+        WLAN_HEADER header = frame->header;
+        if(dtn_routing == DTN_SPRAY && header.dest != neighbour){
+            if(frame->header.copies <= 1){
+                continue;
+            }
+            header.copies = frame->header.copies / 2;
+            frame->header.copies -= header.copies;
+        }
+
+        // This one won't fit, so send what we have and start a new batch
+        if(nframes > 0 && batch.header.length + framelen > capacity){
+            size_t len = sizeof(WLAN_HEADER) + batch.header.length;
+            radio_write(link, &batch, &len, metres);
+            batch.header.length = 0;
+            nframes = 0;
+        }
+        memcpy(batch.payload + batch.header.length, &header, sizeof(WLAN_HEADER));
+        memcpy(batch.payload + batch.header.length + sizeof(WLAN_HEADER), frame->payload, header.length);
+        batch.header.length += framelen;
+        nframes++;
+        ++stats[STAT_DTN_FORWARDED];
+    }
+
+    if(nframes > 0){
+        size_t len = sizeof(WLAN_HEADER) + batch.header.length;
+        radio_write(link, &batch, &len, metres);
+        if(verbose){
+            fprintf(stdout, "mobile [%3d]: contact with [%d] (%d message%s handed over)\n", nodeinfo.address, neighbour, nframes, (nframes == 1) ? "" : "s");
+        }
+    }
+}
+
+// Every frame a mobile hears, with delay-tolerant routing
+// Hellos start a contact; batches for us hold messages to deliver, or to carry on
+static void dtn_receive(WLAN_FRAME *frame)
+{
+    if(frame->header.src < 100){
+        return;
+    }
+    if(frame->header.dtn_summary == true){
+        dtn_contact(frame);
+        return;
+    }
+    if(frame->header.aggregate == false || frame->header.dest != nodeinfo.address){
+        return;
+    }
+
+    size_t offset = 0;
+    while(offset + sizeof(WLAN_HEADER) <= (size_t)frame->header.length){
+        WLAN_FRAME message;
+        memcpy(&message.header, frame->payload + offset, sizeof(WLAN_HEADER));
+        if(offset + sizeof(WLAN_HEADER) + message.header.length > (size_t)frame->header.length){
+            break;
+        }
+        memcpy(message.payload, frame->payload + offset + sizeof(WLAN_HEADER), message.header.length);
+        offset += sizeof(WLAN_HEADER) + message.header.length;
+
+        // It took one more transmission to get here
+        ++message.header.hops;
+        if(message.header.dest == nodeinfo.address){
+            deliver(&message.header);
+            dtn_recent[dtn_recent_next].src = message.header.src;
+            dtn_recent[dtn_recent_next].seqno = message.header.seqno;
+            dtn_recent_next = (dtn_recent_next + 1) % DTN_RECENT;
+        }
+        else{
+            dtn_keep(&message);
+        }
+    }
+}
+
+// An empty buffer, and a first hello at a random time within the first period
+// The buffer has room for dtn_buffer of the longest messages
+static void init_dtn(void)
+{
+    spray_copies = getvar_int("copies", 8);
+    dtn_buffer = getvar_int("dtnbuffer", 200);
+    if(dtn_buffer < 1){
+        dtn_buffer = 1;
+    }
+    init_store(dtn_buffer * 2 * sizeof(STORED_FRAME));
+    memset(dtn_recent, 0, sizeof(dtn_recent));
+    dtn_recent_next = 0;
+
+    CHECK(CNET_set_handler(EV_TIMER6, dtn_hello, 0));
+    CNET_start_timer(EV_TIMER6, 1 + CNET_rand() % HELLO_PERIOD, 0);
+}
+
+
+/*******************************************************************************
+*                        RELAY STORM SUPPRESSION (mobile)                      *
+*******************************************************************************/
+// Relays a frame towards an anchor, if there's (still) one we expect to reach
+static void relay_frame(WLAN_FRAME *frame, size_t len)
+{
+    int link = 1;
+    CnetPosition current_position;
+    CHECK(CNET_get_position(&current_position, NULL));
+
+    int target = relay_anchor(current_position);
+    if(target >= 0){
+        radio_write(link, frame, &len, sqrt(distance_squared(anchor_locations[target], current_position)));
+        ++stats[STAT_RELAYS];
+        fprintf(stdout, "mobile [%3d]: pkt relayed (src=%d, dest=%d)\n", nodeinfo.address, frame->header.src, frame->header.dest);
+    }
+}
+
+// Our wait is over without hearing enough other copies, so relay the frame
+static EVENT_HANDLER(relay_timeout)
+{
+    PENDING_RELAY *pending = &pending_relays[data];
+
+    pending->timer = NULLTIMER;
+    mobility_update();
+    relay_frame(&pending->frame, pending->len);
+}
+
+// Every copy of a message we overhear counts against any relay of it we're waiting to send
+// Returns true if we're already waiting to relay it
+static bool overheard_copy(WLAN_HEADER *header)
+{
+    for(int i=0 ; i<MAX_PENDING_RELAYS ; i++){
+        PENDING_RELAY *pending = &pending_relays[i];
+
+        if(pending->timer != NULLTIMER && pending->frame.header.src == header->src && pending->frame.header.seqno == header->seqno){
+            if(++pending->copies >= relay_threshold){
+                CNET_stop_timer(pending->timer);
+                pending->timer = NULLTIMER;
+                ++stats[STAT_RELAYS_SUPPRESSED];
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// Relays a frame after a random delay, unless overheard_copy cancels it first
+// Without suppression, or if we're already waiting on too many, it goes at once
+static void schedule_relay(WLAN_FRAME *frame, size_t len)
+{
+    CnetPosition current_position;
+    CHECK(CNET_get_position(&current_position, NULL));
+    if(relay_anchor(current_position) < 0){
+        return;
+    }
+
+    if(relay_threshold > 0){
+        for(int i=0 ; i<MAX_PENDING_RELAYS ; i++){
+            PENDING_RELAY *pending = &pending_relays[i];
+
+            if(pending->timer == NULLTIMER){
+                pending->frame = *frame;
+                pending->len = len;
+                pending->copies = 0;
+                pending->timer = CNET_start_timer(EV_TIMER4, 1 + CNET_rand() % RELAY_JITTER, i);
+                return;
+            }
+        }
+    }
+    relay_frame(frame, len);
+}
+
+// Nothing is waiting to be relayed after a reboot
+static void init_relays(void)
+{
+    relay_threshold = getvar_int("relaythreshold", 2);
+    for(int i=0 ; i<MAX_PENDING_RELAYS ; i++){
+        pending_relays[i].timer = NULLTIMER;
+    }
+    CHECK(CNET_set_handler(EV_TIMER4, relay_timeout, 0));
+}
+
+
+/*******************************************************************************
+*                             RECEIVE FRAME (mobile)                           *
+*******************************************************************************/
+static EVENT_HANDLER(receive)
+{
+    // Initalize a frame to catch the received frame
+    WLAN_FRAME	frame;
+    size_t	len;
+    int		link;
+
+
+    // Read the frame, which cost us something to receive
+    len	= sizeof(frame);
+    CHECK(CNET_read_physical(&link, &frame, &len));
+    count_reception(link, len);
+
+    // Bring our position up to date before deciding whether to relay
+    mobility_update();
+
+    // Delay-tolerant routing leaves the anchors out of it
+    if(dtn_routing != DTN_ANCHORS){
+        dtn_receive(&frame);
+        return;
+    }
+
+    // A batch of frames from an anchor is only of interest to the mobile it was built for
+    if(frame.header.aggregate == true){
+        if(frame.header.dest == nodeinfo.address){
+            deliver_aggregate(&frame);
+        }
+        return;
+    }
+
+    // If the frame is from an anchor, check if the mobile is aware of this anchor
+    // If not, add this anchor to our list of anchors
+    // Finally, since the anchor is near us (because we received a message from it), ask the anchor for data
+    // We only ask if the beacon's summary says the anchor probably holds something for us
+    if(frame.header.src < 100){
+        double rssi_dBm;
+        int index = add_known_anchor(frame.header.src, frame.header.srcpos);
+        if(index >= 0 && CNET_wlan_arrival(link, &rssi_dBm, NULL) == 0){
+            heard_anchor(index, rssi_dBm);
+        }
+
+        PENDING_SUMMARY *summary = (PENDING_SUMMARY *)frame.payload;
+        if(bloom_may_contain(summary, nodeinfo.address)){
+            anchor_advertised(index, frame.header.src);
+        }
+        else if(can_i_ask == true){
+            ++stats[STAT_REQUESTS_SKIPPED];
+        }
+
+    }
+    // If the frame is not from an anchor, check if we are the intended recipient
+    // If so, print 'pkt received', unless we have already received this message (directly or via an anchor)
+    // If not, check if the frame has already been forwared. If it hasn't, forward it to an anchor
+    // The frame is only forwared if an anchor is within FORWARDING_DISTANCE meters from this mobile
+    else{
+        if(frame.header.dest == nodeinfo.address) {
+            deliver(&frame.header);
+
+            // A frame sent to us from an anchor's store is acknowledged to that anchor
+            if(custody_transfer == true && frame.header.from_anchor >= 0){
+                MESSAGE_ID id = { frame.header.src, frame.header.seqno };
+                send_custody_ack(frame.header.from_anchor, &id, 1);
+            }
+        }
+        else{
+            if(verbose){
+                //fprintf(stdout, "\tnot mine!\n");
+            }
+            // Requests and acks are only meant for an anchor in range of their sender, so never relay them
+            if(frame.header.anchor_request == true || frame.header.anchor_ack == true){
+                return;
+            }
+            // Another copy of a message we're about to relay makes our own copy less useful
+            if(overheard_copy(&frame.header)){
+                return;
+            }
+            // A copy from an anchor's store is on its way to its destination, not to an anchor
+            if(frame.header.from_anchor >= 0){
+                return;
+            }
+            // Nor do we relay a message twice, however many copies of it go by
+            if(seen_before(&overheard, frame.header.src, frame.header.seqno, RELAY_SEEN_LIFETIME)){
+                ++stats[STAT_RELAYS_SEEN];
+                return;
+            }
+            if(frame.header.hoplimit <= 0){
+                // Only a frame straight from its source is one we'd otherwise have relayed
+                if(frame.header.retransmitted == false){
+                    ++stats[STAT_HOPLIMIT];
+                }
+            }
+            else{
+                --frame.header.hoplimit;
+                ++frame.header.hops;
+                frame.header.retransmitted = true;
+                frame.header.from_anchor = -1;
+                schedule_relay(&frame, len);
+            }
+        }
+    }
+
+}
 
-// Set to false if you don't want details and stuff printed...?
-static	bool		    verbose		= true;
 
-// An array containing mobile and anchor addresses
-// We can store a maximum of 100 addresses
-int mobile_addresses[100];
-int anchor_addresses[100];
+/*******************************************************************************
+*                          ANCHOR CUSTODY OF STORED FRAMES                     *
+*******************************************************************************/
+// Forgets a stored frame, noting how long it was kept
+static void release_frame(int h)
+{
+    STORED_FRAME *s = store_get(h);
 
-// Number of mobile and anchor nodes
-int mobile_count;
-int anchor_count;
+    histogram_add(HIST_RESIDENCY, nodeinfo.time_in_usec - s->stored_at);
+    store_free(h);
+}
 
-// Contains frames to be forwared to a mobile when requested
-// Used only for anchor nodes
-WLAN_FRAME anchor_buffer[20];
+// Called once a stored frame has gone out in a download reply
+// Without custody transfer the frame is forgotten straight away
+// With it, the frame stays (and is sent again on the next request) until the mobile acknowledges it
+static void reply_sent(int h)
+{
+    if(custody_transfer == false){
+        release_frame(h);
+    }
+}
 
-// A list of anchor locations
-// Used only by mobiles
-CnetPosition anchor_locations[100];
-int anchor_locations_count;
+// Releases the frames a mobile has acknowledged
+static void custody_acknowledged(WLAN_FRAME *ack)
+{
+    MESSAGE_ID *ids = (MESSAGE_ID *)ack->payload;
+    int nids = ack->header.length / sizeof(MESSAGE_ID);
+
+    for(int n=0 ; n<nids ; n++){
+        for(int h=store_next(-1) ; h != -1 ; h=store_next(h)){
+            WLAN_HEADER *header = &((STORED_FRAME *)store_get(h))->frame.header;
+            if(header->dest == ack->header.src
+                && header->src == ids[n].src
+                && header->seqno == ids[n].seqno){
+                release_frame(h);
+                ++stats[STAT_CUSTODY_ACKED];
+                if(verbose){
+                    fprintf(stdout, "anchor [%3d]: custody released (src=%d, dest=%d, seq=%d)\n", nodeinfo.address, ids[n].src, ack->header.src, ids[n].seqno);
+                }
+            }
+        }
+    }
+}
 
-// Bool that controls if mobiles can ask anchors for data
-bool can_i_ask;
+// Drops any frame that has outlived CUSTODY_LIFETIME, so a mobile that never comes by can't fill our buffer
+// Its lifetime began when the first anchor stored it, so handing it over doesn't give it a new one
+static void expire_stored_frames(void)
+{
+    for(int h=store_next(-1) ; h != -1 ; h=store_next(h)){
+        STORED_FRAME *s = store_get(h);
+        if(nodeinfo.time_in_usec - s->frame.header.custody_since > CUSTODY_LIFETIME){
+            if(verbose){
+                fprintf(stdout, "anchor [%3d]: custody expired (src=%d, dest=%d, seq=%d)\n", nodeinfo.address, s->frame.header.src, s->frame.header.dest, s->frame.header.seqno);
+            }
+            release_frame(h);
+            ++stats[STAT_CUSTODY_EXPIRED];
+        }
+    }
+}
 
 
 /*******************************************************************************
-*                              CALCULATE DISTANCE                              *
+*                         ANCHOR STORING A RELAYED FRAME                       *
 *******************************************************************************/
-// Calculates the distance between two CnetPositions
-static double distance(CnetPosition p0, CnetPosition p1)
+// Copies a frame into our store, unless we've seen this (src, seqno) before
+// Only the header and the payload it actually uses are copied
+// A frame handed over by another anchor is its only copy, so it's taken even if we've seen it (and kept it) before
+// Returns true if the frame was stored, or (handed over) is already held
+static bool store_frame(WLAN_FRAME *frame, bool handoff)
 {
-    int	dx	= p1.x - p0.x;
-    int	dy	= p1.y - p0.y;
+    if(handoff && find_stored(frame->header.src, frame->header.seqno) >= 0){
+        return true;
+    }
+    int h = store_alloc(STORED_LENGTH(frame->header.length));
+    if(h < 0){
+        ++stats[handoff ? STAT_HANDOFFS_REFUSED : STAT_CUSTODY_REFUSED];
+        return false;
+    }
+    // Only record the seqno once we can actually store the frame, so a later copy still has a chance
+    if(is_duplicate(frame->header.src, frame->header.seqno) && !handoff){
+        store_free(h);
+        return false;
+    }
 
-    return sqrt(dx*dx + dy*dy);
+    // Whoever it's delivered to, the frame will take one more hop to leave us (but only one, however many anchors hold it)
+    STORED_FRAME *s = store_get(h);
+    s->stored_at = nodeinfo.time_in_usec;
+    s->offered_at = 0;
+    memcpy(&s->frame, frame, sizeof(WLAN_HEADER) + frame->header.length);
+    s->frame.header.backbone = false;
+    s->frame.header.from_anchor = -1;
+    if(!handoff){
+        ++s->frame.header.hops;
+        s->frame.header.custody_since = nodeinfo.time_in_usec;
+    }
+    if(verbose) {
+        fprintf(stdout, "anchor [%3d]: frame stored (src=%d, dest=%d, seq=%d)\t", nodeinfo.address, frame->header.src, frame->header.dest, frame->header.seqno);
+        // Prints how much we're holding now
+        fprintf(stdout,"Buffer: %d frames, %zu bytes\n", store_count(), store_bytes());
+    }
+    return true;
 }
 
 
 /*******************************************************************************
-*                                   ASK ANCHOR                                *
+*                          ANCHOR BACKBONE AND REGISTRY                        *
 *******************************************************************************/
-// Every 10 seconds, a mobile is allowed to ask an anchor for data
-// This prevents mobiles from continually asking anchors for data when they're nearby
-static EVENT_HANDLER(ask_anchor)
+// Anchors are connected by a reliable backbone, modelled with CNET_write_direct
+// Frames sent over it arrive on link 1 with the backbone flag set
+// A backbone frame from an anchor (src < 100) carries an announcement or a SIGHTING, or accepts a handoff
+// A backbone frame from a mobile is a stored frame being handed over
+static void backbone_send(int anchor_address, WLAN_FRAME *frame)
 {
-    can_i_ask = true;
-    CNET_start_timer(EV_TIMER3, TX_NEXT, 0);
+    frame->header.backbone = true;
+    size_t len = sizeof(WLAN_HEADER) + frame->header.length;
+    CHECK(CNET_write_direct(anchor_address, frame, &len));
 }
 
-
-/*******************************************************************************
-*                       REQUEST FRAMES FROM NEARBY ANCHOR                      *
-*******************************************************************************/
-void request_from_anchor(int anchor_address_to_request_from)
+// Tells every other anchor where we are
+static void announce_to_peers(void)
 {
-    // Initalize a frame
-    // Send over WLAN link
-    WLAN_FRAME	frame;
-    int	link = 1;
-
-    // The destination is the anchor we want data from
-    frame.header.dest = anchor_address_to_request_from;
-    
-    // Assign other header values
-    frame.header.retransmitted = false;
-    frame.header.anchor_request = true;
-    frame.header.src = nodeinfo.address;
-    CnetPosition current_position;
-    CHECK(CNET_get_position(&current_position, NULL));
-    frame.header.srcpos	= current_position;
-
-    // Generate a payload message and its length
-    sprintf(frame.payload, "Pls give me data! From: %d", nodeinfo.address);
-    frame.header.length	= strlen(frame.payload) + 1;	// send nul-byte too
+    WLAN_FRAME frame;
+    for(int i=0 ; i<anchor_count ; i++){
+        if(anchor_addresses[i] != nodeinfo.address){
+            new_header(&frame.header, anchor_addresses[i]);
+            backbone_send(anchor_addresses[i], &frame);
+        }
+    }
+    announced = true;
+}
 
-    // Transmit the frame
-    size_t len = sizeof(WLAN_HEADER) + frame.header.length;
-    CHECK(CNET_write_physical_reliable(link, &frame, &len));
+// Shares a sighting with every other anchor
+static void share_sighting(SIGHTING *sighting)
+{
+    WLAN_FRAME frame;
+    for(int i=0 ; i<anchor_count ; i++){
+        if(anchor_addresses[i] != nodeinfo.address){
+            new_header(&frame.header, anchor_addresses[i]);
+            memcpy(frame.payload, sighting, sizeof(SIGHTING));
+            frame.header.length = sizeof(SIGHTING);
+            backbone_send(anchor_addresses[i], &frame);
+            ++stats[STAT_SIGHTINGS_SHARED];
+        }
+    }
+}
 
-    // Print that the message was sent
-    if(verbose) {
-        fprintf(stdout, "mobile [%3d]: requesting from anchor [%d]\n", nodeinfo.address, anchor_address_to_request_from);
+// Predicts where a sighted mobile is at time t
+// It walks in a straight line to its waypoint and then stays there
+static CnetPosition predict_position(SIGHTING *sighting, CnetTime t)
+{
+    if(sighting->movement.speed <= 0.0 || t <= sighting->heard_at){
+        return sighting->pos;
     }
+    double dx = sighting->movement.dest.x - sighting->pos.x;
+    double dy = sighting->movement.dest.y - sighting->pos.y;
+    double metres = sqrt(dx*dx + dy*dy);
+    double walked = sighting->movement.speed * (t - sighting->heard_at) / 1000000.0;
 
+    if(walked >= metres){
+        return sighting->movement.dest;
+    }
+    CnetPosition now = sighting->pos;
+    now.x += dx * walked / metres;
+    now.y += dy * walked / metres;
+    return now;
 }
 
-
-/*******************************************************************************
-*                            TRANSMIT FRAME (mobile)                           *
-*******************************************************************************/
-static EVENT_HANDLER(transmit)
+// Predicts when a sighted mobile will be within CONTACT_RANGE of us
+// Solves |pos + v*t - anchor| = CONTACT_RANGE along its walk, then adds its stay at the waypoint
+// That stay is at most PAUSE_TIME, plus however long it takes to walk out of range again
+// The window is left empty if it never comes close enough within PREDICTION_HORIZON, or if we don't know its heading
+static void predict_contact(int index)
 {
-    // Initalize a frame
-    // Send over WLAN link
-    WLAN_FRAME	frame;
-    int	link = 1;
+    SIGHTING *sighting = &mobile_registry[index];
+    CnetPosition anchor;
+    CHECK(CNET_get_position(&anchor, NULL));
 
-    // Find a random destination from our list of mobile addresses
-    do {
-	    frame.header.dest = mobile_addresses[CNET_rand() % 100];
-    } 
-    while (frame.header.dest == nodeinfo.address || frame.header.dest == 0);
-    
-    // Assign other header values
-    frame.header.retransmitted = false;
-    frame.header.anchor_request = false;
-    frame.header.src = nodeinfo.address;
+    CnetTime horizon = sighting->heard_at + PREDICTION_HORIZON;
+    double range2 = CONTACT_RANGE * CONTACT_RANGE;
+    contact_start[index] = contact_end[index] = 0;
 
-    CnetPosition current_position;
-    CHECK(CNET_get_position(&current_position, NULL));
-    frame.header.srcpos	= current_position;
+    if(!sighting->heading_known){
+        return;
+    }
 
-    // Generate a payload message and its length
-    sprintf(frame.payload, "hello from %d", nodeinfo.address);
-    frame.header.length	= strlen(frame.payload) + 1;	// send nul-byte too
+    // Paused, so it's in range until its pause is over and it has walked back out, or not at all
+    if(sighting->movement.speed <= 0.0){
+        double d2 = distance_squared(sighting->pos, anchor);
+        if(d2 <= range2){
+            double stay = PAUSE_TIME + (CONTACT_RANGE - sqrt(d2)) / WALKING_SPEED;
+            contact_start[index] = sighting->heard_at;
+            contact_end[index] = sighting->heard_at + (CnetTime)(stay * 1000000.0);
+            if(contact_end[index] > horizon){
+                contact_end[index] = horizon;
+            }
+        }
+        return;
+    }
 
-    // Transmit the frame
-    size_t len = sizeof(WLAN_HEADER) + frame.header.length;
-    CHECK(CNET_write_physical_reliable(link, &frame, &len));
-    ++stats[0];
+    double dx = sighting->movement.dest.x - sighting->pos.x;
+    double dy = sighting->movement.dest.y - sighting->pos.y;
+    double metres = sqrt(dx*dx + dy*dy);
+    if(metres == 0.0){
+        return;
+    }
+    double walk_secs = metres / sighting->movement.speed;
+    double vx = dx / walk_secs;
+    double vy = dy / walk_secs;
+    double px = sighting->pos.x - anchor.x;
+    double py = sighting->pos.y - anchor.y;
+
+    double a = vx*vx + vy*vy;
+    double b = 2.0 * (px*vx + py*vy);
+    double c = px*px + py*py - range2;
+    double discriminant = b*b - 4.0*a*c;
+    if(discriminant < 0.0){
+        return;                         // its line of travel never comes close enough
+    }
+    double enter = (-b - sqrt(discriminant)) / (2.0*a);
+    double leave = (-b + sqrt(discriminant)) / (2.0*a);
+    if(enter < 0.0){
+        enter = 0.0;
+    }
 
-    // Print that the message was sent
-    if(verbose) {
-        fprintf(stdout, "mobile [%3d]: pkt transmitted (src=%d, dest=%d)\n", nodeinfo.address, frame.header.src, frame.header.dest);
+    // If the waypoint is in range, it stays in range while it pauses there, and until it walks back out
+    double waypoint_d2 = distance_squared(sighting->movement.dest, anchor);
+    if(waypoint_d2 <= range2){
+        leave = walk_secs + PAUSE_TIME + (CONTACT_RANGE - sqrt(waypoint_d2)) / sighting->movement.speed;
+    }
+    else if(leave > walk_secs){
+        leave = walk_secs;
+    }
+    if(enter >= leave){
+        return;
     }
 
-    // SCHEDULE OUR NEXT TRANSMISSION
-    CNET_start_timer(EV_TIMER1, TX_NEXT, 0);
+    contact_start[index] = sighting->heard_at + (CnetTime)(enter * 1000000.0);
+    contact_end[index] = sighting->heard_at + (CnetTime)(leave * 1000000.0);
+    if(contact_end[index] > horizon){
+        contact_end[index] = horizon;
+    }
 }
 
-
-/*******************************************************************************
-*                             RECEIVE FRAME (mobile)                           *
-*******************************************************************************/
-static EVENT_HANDLER(receive)
+// Records a sighting of a mobile, if it's newer than what we know
+// A sighting without a heading keeps the previous one, provided the mobile is where that heading said it would be
+// Sightings we made ourselves are passed on to the other anchors, at most every SIGHTING_SHARE_INTERVAL
+static void record_sighting(SIGHTING *sighting, bool heard_by_me)
 {
-    // Initalize a frame to catch the received frame
-    WLAN_FRAME	frame;
-    size_t	len;
-    int		link;
+    int index = mobile_index(sighting->address);
+    if(index < 0 || sighting->heard_at <= mobile_registry[index].heard_at){
+        return;
+    }
 
-    // Read the frame
-    len	= sizeof(frame);
-    CHECK(CNET_read_physical(&link, &frame, &len));
+    SIGHTING *known = &mobile_registry[index];
+    if(!sighting->heading_known && known->heading_known){
+        CnetPosition expected = predict_position(known, sighting->heard_at);
+        if(distance_squared(expected, sighting->pos) <= ON_COURSE_DISTANCE * ON_COURSE_DISTANCE){
+            sighting->movement = known->movement;
+            sighting->heading_known = true;
+        }
+    }
+    *known = *sighting;
+    predict_contact(index);
 
-    // If the frame is from an anchor, check if the mobile is aware of this anchor
-    // If not, add this anchor to our list of anchors
-    // Finally, since the anchor is near us (because we received a message from it), ask the anchor for data
-    if(frame.header.src < 100){
-        bool found = false;
-        for(int i=0 ; i<100 ; i++){
-            if(frame.header.srcpos.x == anchor_locations[i].x && frame.header.srcpos.y == anchor_locations[i].y){
-                found = true;
-                break;
-            }
+    if(heard_by_me && (registry_shared_at[index] == 0 || known->heard_at - registry_shared_at[index] >= SIGHTING_SHARE_INTERVAL)){
+        registry_shared_at[index] = known->heard_at;
+        share_sighting(known);
+    }
+}
+
+// Returns the address of the anchor (possibly us) closest to pos, among those we know of
+static int anchor_nearest_to(CnetPosition pos)
+{
+    CnetPosition my_position;
+    CHECK(CNET_get_position(&my_position, NULL));
+
+    int best = nodeinfo.address;
+    double best_d2 = distance_squared(my_position, pos);
+    for(int i=0 ; i<anchor_count ; i++){
+        if(peer_anchor_known[i] && distance_squared(peer_anchor_positions[i], pos) < best_d2){
+            best_d2 = distance_squared(peer_anchor_positions[i], pos);
+            best = anchor_addresses[i];
         }
-        if(!found){
-            anchor_locations[anchor_locations_count] = frame.header.srcpos;
-            anchor_locations_count++;
+    }
+    return best;
+}
+
+// Offers each stored frame to the anchor closest to where its destination was last heard
+// A frame is only offered if we've learnt something new about its destination since we stored it (or last offered it)
+// That stops two anchors with the same information passing a frame back and forth
+// We keep the frame until the other anchor accepts it, as it may have no room
+static void handoff_stored_frames(void)
+{
+    for(int h=store_next(-1) ; h != -1 ; h=store_next(h)){
+        STORED_FRAME *s = store_get(h);
+        int index = mobile_index(s->frame.header.dest);
+        if(index < 0 || mobile_registry[index].heard_at <= s->stored_at || mobile_registry[index].heard_at <= s->offered_at){
+            continue;
         }
-        if(can_i_ask == true){
-            can_i_ask = false;
-            request_from_anchor(frame.header.src);
+        int target = anchor_nearest_to(predict_position(&mobile_registry[index], nodeinfo.time_in_usec));
+        if(target != nodeinfo.address){
+            if(verbose){
+                fprintf(stdout, "anchor [%3d]: handoff to anchor [%d] (src=%d, dest=%d, seq=%d)\n", nodeinfo.address, target,
+                        s->frame.header.src, s->frame.header.dest, s->frame.header.seqno);
+            }
+            WLAN_FRAME frame;
+            memcpy(&frame, &s->frame, sizeof(WLAN_HEADER) + s->frame.header.length);
+            frame.header.from_anchor = nodeinfo.address;
+            backbone_send(target, &frame);
+            s->offered_at = nodeinfo.time_in_usec;
         }
+    }
+}
+
+// Tells the anchor that handed us a frame that we've taken it, so it can forget its copy
+static void accept_handoff(WLAN_FRAME *handed)
+{
+    WLAN_FRAME frame;
+    MESSAGE_ID id = { handed->header.src, handed->header.seqno };
+
+    new_header(&frame.header, handed->header.from_anchor);
+    frame.header.anchor_ack = true;
+    memcpy(frame.payload, &id, sizeof(id));
+    frame.header.length = sizeof(id);
+    backbone_send(handed->header.from_anchor, &frame);
+}
 
+// Another anchor has accepted a frame we offered it
+static void handoff_accepted(WLAN_FRAME *ack)
+{
+    MESSAGE_ID id;
+    memcpy(&id, ack->payload, sizeof(id));
+
+    int h = find_stored(id.src, id.seqno);
+    if(h >= 0){
+        release_frame(h);
+        ++stats[STAT_HANDOFFS];
+        if(verbose){
+            fprintf(stdout, "anchor [%3d]: handoff accepted by anchor [%d] (src=%d, seq=%d)\n", nodeinfo.address, ack->header.src, id.src, id.seqno);
+        }
     }
-    // If the frame is not from an anchor, check if we are the intended recipient
-    // If so, print 'pkt received'
-    // If not, check if the frame has already been forwared. If it hasn't, forward it to an anchor
-    // The frame is only forwared if an anchor is within FORWARDING_DISTANCE meters from this mobile
-    else{
-        if(frame.header.dest == nodeinfo.address) {
-            ++stats[1];
-            if(verbose){
-                //fprintf(stdout, "\tfor me!\n");
-                fprintf(stdout, "mobile [%3d]: pkt received (src=%d, dest=%d)\n", nodeinfo.address, frame.header.src, frame.header.dest);
-            }
+}
+
+// Handles a frame that arrived over the backbone
+static void receive_backbone(WLAN_FRAME *frame)
+{
+    // Another anchor accepting a frame we handed it
+    if(frame->header.anchor_ack == true){
+        if(frame->header.length == sizeof(MESSAGE_ID)){
+            handoff_accepted(frame);
+        }
+    }
+    else if(frame->header.src < 100){
+        // A sighting from another anchor
+        if(frame->header.length == sizeof(SIGHTING)){
+            SIGHTING sighting;
+            memcpy(&sighting, frame->payload, sizeof(SIGHTING));
+            record_sighting(&sighting, false);
         }
+        // An anchor announcing its position
         else{
-            if(verbose){
-                //fprintf(stdout, "\tnot mine!\n");
-            }
-            if(frame.header.retransmitted == false && frame.header.anchor_request == false){
-                frame.header.retransmitted = true;
-                CnetPosition current_position;
-                CHECK(CNET_get_position(&current_position, NULL));
-                for(int i=0 ; i<100 ; i++){
-                    if(distance(anchor_locations[i], current_position) < FORWARDING_DISTANCE){
-                        CHECK(CNET_write_physical_reliable(link, &frame, &len));
-                        fprintf(stdout, "mobile [%3d]: pkt relayed (src=%d, dest=%d)\n", nodeinfo.address, frame.header.src, frame.header.dest);
-                        break;
-                    }
+            for(int i=0 ; i<anchor_count ; i++){
+                if(anchor_addresses[i] == frame->header.src){
+                    peer_anchor_positions[i] = frame->header.srcpos;
+                    peer_anchor_known[i] = true;
                 }
             }
         }
     }
-
+    // A frame handed over by another anchor, which keeps it until we say we've taken it
+    else if(store_frame(frame, true) && frame->header.from_anchor >= 0){
+        accept_handoff(frame);
+    }
 }
 
 
 /*******************************************************************************
 *                       ANCHOR REPLYING TO MOBILE REQUEST                      *
 *******************************************************************************/
+// Transmits a batch built by anchor_download_reply
+// A batch of one is sent as the original frame, so it doesn't pay for a second header
+static void send_batch(WLAN_FRAME *batch, WLAN_FRAME *single, int nframes)
+{
+    int link = 1;
+    WLAN_FRAME *frame = (nframes == 1) ? single : batch;
+    size_t len = sizeof(WLAN_HEADER) + frame->header.length;
+
+    // Just enough power to reach where we expect the mobile to be now
+    double metres = -1.0;
+    int index = mobile_index(batch->header.dest);
+    if(index >= 0 && mobile_registry[index].heard_at > 0){
+        CnetPosition here;
+        CHECK(CNET_get_position(&here, NULL));
+        metres = sqrt(distance_squared(predict_position(&mobile_registry[index], nodeinfo.time_in_usec), here));
+    }
+    // So the mobile knows whom to acknowledge it to
+    frame->header.from_anchor = nodeinfo.address;
+    mac_write(link, frame, len, metres);
+    ++stats[STAT_REPLY_FRAMES];
+    stats[STAT_REPLY_MESSAGES] += nframes;
+    stats[STAT_REPLY_BYTES] += len;
+    fprintf(stdout, "anchor [%3d]: download reply (dest=%d, %d frame%s)\n", nodeinfo.address, batch->header.dest, nframes, (nframes == 1) ? "" : "s");
+}
+
 // When an anchor receives a request from a mobile, it sends any data intended for that mobile that it has stored in its buffer
+// Frames are packed back to back into as few maximum-size frames as possible
 void anchor_download_reply(int address_of_mobile_requesting_data)
 {
-    // Loop through anchor's buffer list and check for the requesting mobile as a 'dest'
-    for(int i=0 ; i<20 ; i++){
-        if(anchor_buffer[i].header.dest == address_of_mobile_requesting_data){
-            
-            // Send the frame to the appropriate mobile
-            WLAN_FRAME frame;
-            frame = anchor_buffer[i];
-            int link = 1;
-            size_t len = sizeof(WLAN_HEADER) + frame.header.length;
-            CHECK(CNET_write_physical_reliable(link, &frame, &len));
-            fprintf(stdout, "anchor [%3d]: download reply (src=%d, dest=%d)\n", nodeinfo.address, frame.header.src, frame.header.dest);
+    int link = 1;
+
+    // Remember this, so we don't push the same frames again straight away
+    int index = mobile_index(address_of_mobile_requesting_data);
+    if(index >= 0){
+        replied_at[index] = nodeinfo.time_in_usec;
+    }
+
+    // The largest batch payload that fits both in our frame and in one WLAN transmission
+    size_t capacity = linkinfo[link].mtu - sizeof(WLAN_HEADER);
+    if(capacity > sizeof(((WLAN_FRAME *)NULL)->payload)){
+        capacity = sizeof(((WLAN_FRAME *)NULL)->payload);
+    }
+
+    WLAN_FRAME batch;
+    new_header(&batch.header, address_of_mobile_requesting_data);
+    batch.header.aggregate = true;
+
+    int nframes = 0;
+    int last = -1;
+
+    // Loop through anchor's stored frames and check for the requesting mobile as a 'dest'
+    // A frame sent on its own goes straight from the store
+    for(int h=store_next(-1) ; h != -1 ; h=store_next(h)){
+        WLAN_FRAME *frame = &((STORED_FRAME *)store_get(h))->frame;
+        if(frame->header.dest == address_of_mobile_requesting_data){
+            size_t framelen = sizeof(WLAN_HEADER) + frame->header.length;
+
+            // A frame too big to share a batch goes on its own
+            if(framelen > capacity){
+                send_batch(&batch, frame, 1);
+                reply_sent(h);
+                continue;
+            }
+
+            // This frame won't fit, so send what we have and start a new batch
+            if(nframes > 0 && batch.header.length + framelen > capacity){
+                send_batch(&batch, &((STORED_FRAME *)store_get(last))->frame, nframes);
+                reply_sent(last);
+                batch.header.length = 0;
+                nframes = 0;
+                last = -1;
+            }
+
+            memcpy(batch.payload + batch.header.length, frame, framelen);
+            batch.header.length += framelen;
+            nframes++;
+
+            // The previous frame is now safely in the batch
+            // The latest one is kept until its batch is sent, in case it ends up in a batch of its own
+            if(last >= 0){
+                reply_sent(last);
+            }
+            last = h;
+        }
+    }
+
+    if(nframes > 0){
+        send_batch(&batch, &((STORED_FRAME *)store_get(last))->frame, nframes);
+        reply_sent(last);
+    }
+}
+
 
-            // Effectively 'clear' that frame from the buffer by making the src and dest zero
-            anchor_buffer[i].header.dest = 0;
-            anchor_buffer[i].header.src = 0;
+/*******************************************************************************
+*                        ANCHOR PUSHING TO PREDICTED CONTACTS                  *
+*******************************************************************************/
+// Sends stored frames, unasked, to any mobile we predict is in range right now
+// Mobiles handle a push exactly like the reply to a request
+// Only in custody-transfer mode, where a frame pushed to a mobile that isn't there is kept until one is acknowledged
+static void push_to_predicted_contacts(void)
+{
+    CnetTime now = nodeinfo.time_in_usec;
+
+    if(custody_transfer == false){
+        return;
+    }
 
+    for(int h=store_next(-1) ; h != -1 ; h=store_next(h)){
+        STORED_FRAME *s = store_get(h);
+        int dest = s->frame.header.dest;
+        int index = mobile_index(dest);
+        if(index < 0){
+            continue;
+        }
+        if(now >= contact_start[index] && now < contact_end[index] && now - replied_at[index] >= PUSH_INTERVAL){
+            if(verbose){
+                fprintf(stdout, "anchor [%3d]: push to predicted contact (dest=%d)\n", nodeinfo.address, dest);
+            }
+            anchor_download_reply(dest);
+            ++stats[STAT_PUSHES];
         }
     }
 }
@@ -288,42 +1998,34 @@ static EVENT_HANDLER(receive_anchor){
     len	= sizeof(frame);
     CHECK(CNET_read_physical(&link, &frame, &len));
    
-    // Check if the frame is meant for retransmission
-    // If so, make sure it's not already in our buffer (two mobiles can relay the same frame)
-    // If not in the anchor's buffer, add it to an empty slot in the buffer
-    if(frame.header.retransmitted == true && frame.header.anchor_request == false){
-        bool found = false;
-        for(int i=0 ; i<20 ; i++){
-            if(anchor_buffer[i].header.dest == frame.header.dest 
-                && anchor_buffer[i].header.src == frame.header.src 
-                && anchor_buffer[i].header.length == frame.header.length){
-                    found = true;
-                    break;
-                }
+    // Frames from other anchors are handled separately
+    if(frame.header.backbone == true){
+        receive_backbone(&frame);
+        return;
+    }
+
+    // Anything a mobile sends itself (not relayed) tells us where that mobile is right now
+    // Its download requests also tell us where it's heading
+    if(frame.header.src >= 100 && frame.header.retransmitted == false){
+        SIGHTING sighting;
+        memset(&sighting, 0, sizeof(sighting));
+        sighting.address = frame.header.src;
+        sighting.pos = frame.header.srcpos;
+        sighting.heard_at = nodeinfo.time_in_usec;
+        if(frame.header.anchor_request == true && frame.header.length == sizeof(MOVEMENT)){
+            memcpy(&sighting.movement, frame.payload, sizeof(MOVEMENT));
+            sighting.heading_known = true;
         }
-        if(found==false){
-            for(int i=0 ; i<20 ; i++){
-                if(anchor_buffer[i].header.dest == 0 && anchor_buffer[i].header.src == 0){
-                    anchor_buffer[i] = frame;
-                    if(verbose) {
-                        double	rx_signal;
-                        CHECK(CNET_wlan_arrival(link, &rx_signal, NULL));
-                        fprintf(stdout, "anchor [%3d]: frame stored (src=%d, dest=%d)\t", nodeinfo.address, frame.header.src, frame.header.dest);
-                        // Prints the buffer's capacity. A '1' indicates that slot is occupied, '0' indicates that slot is empty
-                        fprintf(stdout,"Buffer Capacity: [");
-                        for(int i=0 ; i<20 ; i++){
-                            if(anchor_buffer[i].header.dest == 0 && anchor_buffer[i].header.src == 0){
-                                fprintf(stdout,"0");
-                            }
-                            else{
-                                fprintf(stdout,"1");
-                            }
-                        }
-                        fprintf(stdout,"]\n");
-                    }
-                    break;
-                }
-            }
+        record_sighting(&sighting, true);
+    }
+
+    // Check if the frame is meant for retransmission
+    // If so, make sure we haven't seen this (src, seqno) before (two mobiles can relay the same frame)
+    // If it's new, add it to our store
+    // Another anchor's download reply is not a relay, and is its to keep
+    if(frame.header.retransmitted == true && frame.header.anchor_request == false && frame.header.from_anchor < 0){
+        if(store_frame(&frame, false)){
+            ++stats[STAT_RELAYS_HEARD];
         }
     }
     // If the frame is a mobile asking an anchor for data, send that mobile any of its data that is stored in this buffer
@@ -331,6 +2033,10 @@ static EVENT_HANDLER(receive_anchor){
         fprintf(stdout, "anchor [%3d]: download request (src=%d, dest=%d)\n", nodeinfo.address, frame.header.src, frame.header.dest);
         anchor_download_reply(frame.header.src);
     }
+    // If the frame is a mobile acknowledging frames it has received, we no longer need to keep them
+    else if(frame.header.anchor_ack == true){
+        custody_acknowledged(&frame);
+    }
 
 }
 
@@ -342,6 +2048,7 @@ static EVENT_HANDLER(receive_anchor){
 // This beacon goes off every second
 // It serves the purpose of letting mobiles know the anchor location (when the program is starting up)
 // Additionally, when mobiles hear this beacon, they know an anchor is nearby, so they request the data from this anchor
+// The payload summarises which mobiles we hold frames for, so the others don't bother asking
 static EVENT_HANDLER(broadcast_beacon){
 
     // Initalize a frame
@@ -349,37 +2056,133 @@ static EVENT_HANDLER(broadcast_beacon){
     int		link	= 1;
 
     // There's no intended destination for this frame. It's a general signal to all mobiles
-    frame.header.dest = 1000;
-    frame.header.src = nodeinfo.address;
-
     // The position of this anchor is stored, so mobiles can extract/store this location
-    CnetPosition anchor_position;
-    CHECK(CNET_get_position(&anchor_position, NULL));
-    frame.header.srcpos	= anchor_position;	// me!
+    new_header(&frame.header, 1000);
 
-    // Anchor payload not necessary, but we just say hi
-    sprintf(frame.payload, "hello from anchor %d", nodeinfo.address);
-    frame.header.length	= strlen(frame.payload) + 1;	// send nul-byte too
+    // The first time around, let the other anchors know where we are
+    if(announced == false){
+        announce_to_peers();
+    }
+
+    // Give up on frames that have been waiting too long, and move others closer to their destination
+    expire_stored_frames();
+    handoff_stored_frames();
+
+    // Deliver to anyone we expect to be passing by, rather than waiting for them to ask
+    push_to_predicted_contacts();
+
+    // Note how full our store is now
+    histogram_add(HIST_OCCUPANCY, store_count());
+
+    // The payload is a Bloom filter of every destination in our store
+    PENDING_SUMMARY summary;
+    memset(&summary, 0, sizeof(summary));
+    for(int h=store_next(-1) ; h != -1 ; h=store_next(h)){
+        STORED_FRAME *s = store_get(h);
+        bloom_add(&summary, s->frame.header.dest);
+    }
+    memcpy(frame.payload, &summary, sizeof(summary));
+    frame.header.length	= sizeof(summary);
     size_t len	= sizeof(WLAN_HEADER) + frame.header.length;
 
-    // TRANSMIT THE FRAME
-    CHECK(CNET_write_physical_reliable(link, &frame, &len));
+    // TRANSMIT THE FRAME, at full power so every mobile in range hears it
+    mac_write(link, &frame, len, -1.0);
 
     // Send a beacon every second
-    CNET_start_timer(EV_TIMER2, 1000000, 0);
+    CNET_start_timer(EV_TIMER2, BEACON_PERIOD, 0);
 }
 
 
 /*******************************************************************************
 *                              SUMMARY STATISTICS                              *
 *******************************************************************************/
+static void print_statistics(void)
+{
+    fprintf(stdout, "messages generated:\t%d\n", stats[STAT_GENERATED]);
+    fprintf(stdout, "messages received:\t%d\n", stats[STAT_RECEIVED]);
+    fprintf(stdout, "duplicates discarded:\t%d\n", stats[STAT_DUPLICATES]);
+    fprintf(stdout, "anchor requests:\t%d\n", stats[STAT_REQUESTS]);
+    fprintf(stdout, "requests skipped:\t%d\n", stats[STAT_REQUESTS_SKIPPED]);
+
+    if(stats[STAT_GENERATED] > 0){
+	    fprintf(stdout, "delivery ratio:\t\t%.1f%%\n", 100.0*stats[STAT_RECEIVED]/stats[STAT_GENERATED]);
+    }
+
+    // What happened to frames held by anchors
+    fprintf(stdout, "custody acknowledged:\t%d\n", stats[STAT_CUSTODY_ACKED]);
+    fprintf(stdout, "custody expired:\t%d\n", stats[STAT_CUSTODY_EXPIRED]);
+    fprintf(stdout, "custody refused:\t%d\n", stats[STAT_CUSTODY_REFUSED]);
+    fprintf(stdout, "backbone handoffs:\t%d\n", stats[STAT_HANDOFFS]);
+    fprintf(stdout, "handoffs refused:\t%d\n", stats[STAT_HANDOFFS_REFUSED]);
+    fprintf(stdout, "sightings shared:\t%d\n", stats[STAT_SIGHTINGS_SHARED]);
+    fprintf(stdout, "anchor pushes:\t\t%d\n", stats[STAT_PUSHES]);
+    fprintf(stdout, "hop limit reached:\t%d\n", stats[STAT_HOPLIMIT]);
+    fprintf(stdout, "reduced power frames:\t%d\n", stats[STAT_REDUCED_POWER]);
+
+    // How many relays each delivery cost, and how many were saved
+    fprintf(stdout, "mobile relays:\t\t%d", stats[STAT_RELAYS]);
+    if(stats[STAT_RECEIVED] > 0){
+        fprintf(stdout, " (%.2f per delivered message)", (double)stats[STAT_RELAYS] / stats[STAT_RECEIVED]);
+    }
+    fprintf(stdout, "\n");
+    fprintf(stdout, "relays suppressed:\t%d\n", stats[STAT_RELAYS_SUPPRESSED]);
+    fprintf(stdout, "relays already seen:\t%d\n", stats[STAT_RELAYS_SEEN]);
+    fprintf(stdout, "relays at anchors:\t%d\n", stats[STAT_RELAYS_HEARD]);
+
+    // What delay-tolerant routing cost, when it's used
+    if(dtn_routing != DTN_ANCHORS){
+        fprintf(stdout, "messages forwarded:\t%d\n", stats[STAT_DTN_FORWARDED]);
+        fprintf(stdout, "buffer drops:\t\t%d\n", stats[STAT_DTN_DROPPED]);
+        fprintf(stdout, "buffer expired:\t\t%d\n", stats[STAT_DTN_EXPIRED]);
+    }
+
+    // Every frame sent, so different routing can be compared
+    fprintf(stdout, "frames transmitted:\t%d", stats[STAT_TRANSMISSIONS]);
+    if(stats[STAT_RECEIVED] > 0){
+        fprintf(stdout, " (%.2f per delivered message)", (double)stats[STAT_TRANSMISSIONS] / stats[STAT_RECEIVED]);
+    }
+    fprintf(stdout, "\n");
+
+    // How well download replies were packed into frames
+    if(stats[STAT_REPLY_FRAMES] > 0){
+        fprintf(stdout, "reply frames:\t\t%d (%d messages, %.2f per frame)\n", stats[STAT_REPLY_FRAMES],
+                stats[STAT_REPLY_MESSAGES], (double)stats[STAT_REPLY_MESSAGES]/stats[STAT_REPLY_FRAMES]);
+        fprintf(stdout, "reply bytes:\t\t%d\n", stats[STAT_REPLY_BYTES]);
+    }
+
+    // What the mobiles' radios cost
+    fprintf(stdout, "radio energy:\t\t%.3f J", energy[ENERGY_RADIO_mJ] / 1000.0);
+    if(stats[STAT_RECEIVED] > 0){
+        fprintf(stdout, " (%.3f mJ per delivered message)", energy[ENERGY_RADIO_mJ] / stats[STAT_RECEIVED]);
+    }
+    fprintf(stdout, "\n");
+    fprintf(stdout, "battery drained:\t%.3f J\n", energy[ENERGY_BATTERY_mJ] / 1000.0);
+    if(energy[ENERGY_ASLEEP_SECS] + energy[ENERGY_AWAKE_SECS] > 0){
+        fprintf(stdout, "radios asleep:\t\t%.1f%%\n", 100.0*energy[ENERGY_ASLEEP_SECS] / (energy[ENERGY_ASLEEP_SECS] + energy[ENERGY_AWAKE_SECS]));
+    }
+
+    // The cost of store-and-forward, not just whether it worked
+    histogram_print(HIST_DELAY, "end-to-end delay:", 1000000.0, "s");
+    histogram_print(HIST_HOPS, "hops:", 1.0, "");
+    histogram_print(HIST_RESIDENCY, "anchor residency:", 1000000.0, "s");
+    histogram_print(HIST_OCCUPANCY, "anchor occupancy:", 1.0, "frames");
+
+    // How busy the medium was
+    mac_print_stats();
+}
+
+// Every node adds what it has left uncounted (and closes any recording of its walk), and the last one to shut down prints the totals
+// NNODES is only known when cnet is run with -N, otherwise every node is named in var mobiles or var anchors
 static EVENT_HANDLER(finished)
 {
-    fprintf(stdout, "messages generated:\t%d\n", stats[0]);
-    fprintf(stdout, "messages received:\t%d\n", stats[1]);
+    if(nodeinfo.nodetype == NT_MOBILE){
+        count_energy();
+        mobility_finish();
+    }
 
-    if(stats[0] > 0){
-	    fprintf(stdout, "delivery ratio:\t\t%.1f%%\n", 100.0*stats[1]/stats[0]);
+    int nnodes = (NNODES > 0) ? NNODES : mobile_count + anchor_count;
+    if(++*nodes_finished == nnodes){
+        print_statistics();
     }
 }
 
@@ -426,55 +2229,111 @@ EVENT_HANDLER(reboot_node)
     parse_string(mobile_string, 'm');
     parse_string(anchor_string, 'a');
 
+    // Nothing has been seen from any source yet
+    memset(dup_windows, 0, sizeof(dup_windows));
+    memset(&delivered, 0, sizeof(delivered));
+    memset(&overheard, 0, sizeof(overheard));
+
+    // Anchors and mobiles must agree on whether frames are acknowledged
+    custody_transfer = getvar_int("custody", 0) != 0;
+
+    // And on whether messages go through the anchors at all
+    char *routing = CNET_getvar("routing");
+    dtn_routing = DTN_ANCHORS;
+    if(routing != NULL && strcmp(routing, "epidemic") == 0){
+        dtn_routing = DTN_EPIDEMIC;
+    }
+    else if(routing != NULL && strcmp(routing, "spray") == 0){
+        dtn_routing = DTN_SPRAY;
+    }
+
+    // ALLOCATE MEMORY FOR SHARED MEMORY SEGMENTS
+    // Both anchors and mobiles update the global statistics
+    stats	= CNET_shmem2("s", NSTATS*sizeof(int));
+    nodes_finished	= CNET_shmem2("f", sizeof(int));
+    init_histograms(NHISTOGRAMS);
+    energy	= CNET_shmem2("e", NENERGY*sizeof(double));
+
+    // Use our own propagation model, if the topology file asks for it
+    init_wlan_model();
+    init_power_control();
+
+    // Every node's random choices (the MAC layer's backoffs, as well as a mobile's walk and traffic)
+    // are seeded from 'var seed' if it's given, so runs can be repeated exactly
+    CNET_srand(mobility_seed() + nodeinfo.nodenumber);
+
+    // Every frame waits for the medium to be free, unless the topology file turns the MAC layer off
+    init_mac(physical_write);
+
+    // Print statistics when simulation ends
+    CHECK(CNET_set_handler(EV_SHUTDOWN,  finished, 0));
+
     // Reboot sequence for an anchor
     if(nodeinfo.nodetype == NT_HOST){
         CHECK(CNET_set_handler(EV_PHYSICALREADY,  receive_anchor, 0));
         CHECK(CNET_set_handler(EV_TIMER2, broadcast_beacon, 0));
-        CNET_start_timer(EV_TIMER2, 1000000, 0);
-
-        // Clear our buffer
-        for(int i=0 ; i<20 ; i++){
-            anchor_buffer[i].header.dest = 0;
-            anchor_buffer[i].header.src = 0;
+        // Anchors stay quiet if the mobiles route among themselves
+        if(dtn_routing == DTN_ANCHORS){
+            CNET_start_timer(EV_TIMER2, BEACON_PERIOD, 0);
         }
+
+        // Start with an empty store
+        init_store(getvar_int("anchorstore", ANCHOR_STORE_BYTES));
+
+        // We haven't heard from any mobile or other anchor yet
+        memset(mobile_registry, 0, sizeof(mobile_registry));
+        memset(registry_shared_at, 0, sizeof(registry_shared_at));
+        memset(peer_anchor_known, 0, sizeof(peer_anchor_known));
+        memset(contact_start, 0, sizeof(contact_start));
+        memset(contact_end, 0, sizeof(contact_end));
+        memset(replied_at, 0, sizeof(replied_at));
+        announced = false;
     }
 
     // Reboot sequence for a mobile
     if(nodeinfo.nodetype == NT_MOBILE){
         
         // Initially, we know the locations of no anchors
-        anchor_locations_count = 0;
+        init_anchor_grid();
         // Initially, mobiles can ask for data from anchors
         can_i_ask = true;
+        // Our first message will be seqno 1
+        next_seqno = 1;
 
-        // Declar the external function?
-        extern void init_mobility(double walkspeed_m_per_sec, int pausetime_secs, int nnodes);
 
         // Check for proper version of CNET
         CNET_check_version(CNET_VERSION);
-        CNET_srand(time(NULL) + nodeinfo.nodenumber);
 
         // Call init_mobility to set up the mobile movements
         init_mobility(WALKING_SPEED, PAUSE_TIME, mobile_count);
 
-        // ALLOCATE MEMORY FOR SHARED MEMORY SEGMENTS
-        stats	= CNET_shmem2("s", 2*sizeof(int));
+        // And init_traffic to choose how we'll generate messages for the other mobiles
+        init_traffic(mobile_addresses, mobile_count);
+
+        // Start counting energy, and sleeping between beacons if we're duty cycling
+        init_radio();
+
+        // A TIMER4 event sends a relay we've been holding back
+        init_relays();
+
+        // A TIMER7 event asks the strongest anchor that advertised something for us
+        init_anchor_rssi();
+
+        // A TIMER6 event sends a hello, if mobiles route among themselves
+        if(dtn_routing != DTN_ANCHORS){
+            init_dtn();
+        }
 
         // Set the event handles for mobiles
         // A TIMER1 event causes new transmissions
         // A TIMER3 event resets the 'request from anchor' to true
         CHECK(CNET_set_handler(EV_TIMER1, transmit, 0));
         CHECK(CNET_set_handler(EV_TIMER3, ask_anchor, 0));
-        CNET_start_timer(EV_TIMER1, TX_NEXT, 0);
+        CNET_start_timer(EV_TIMER1, traffic_next_interval(), 0);
         CNET_start_timer(EV_TIMER3, 1000000, 0);
 
         // Set event handler for when a physical layer message is received
         CHECK(CNET_set_handler(EV_PHYSICALREADY,  receive, 0));
-
-        // Print statistics when simulation ends
-        if(nodeinfo.nodenumber == 0){
-            CHECK(CNET_set_handler(EV_SHUTDOWN,  finished, 0));
-        }
     }
 
 }
@@ -0,0 +1,71 @@
+#ifndef	LAB3_H
+#define	LAB3_H
+
+#include <cnet.h>
+#include <stdlib.h>
+
+//  A 'var' FROM THE TOPOLOGY FILE, OR fallback IF IT ISN'T DEFINED
+static inline int getvar_int(const char *name, int fallback)
+{
+    char	*value	= CNET_getvar(name);
+
+    if(value == NULL || *value == '\0') {
+        return fallback;
+    }
+    return atoi(value);
+}
+
+static inline double getvar_double(const char *name, double fallback)
+{
+    char	*value	= CNET_getvar(name);
+
+    if(value == NULL || *value == '\0') {
+        return fallback;
+    }
+    return atof(value);
+}
+
+//  THE FUNCTIONS EACH SUPPORT MODULE OFFERS lab3.c (AND EACH OTHER)
+
+//  mobility.c
+extern	void		init_mobility(double walkspeed_metres_per_sec, int pausetime_secs, int nnodes);
+extern	void		mobility_update(void);
+extern	bool		mobility_heading(CnetPosition *dest, double *speed_metres_per_sec);
+extern	unsigned int	mobility_seed(void);
+extern	void		mobility_finish(void);
+
+//  traffic.c
+extern	void		init_traffic(const int *mobiles, int nmobiles);
+extern	CnetTime	traffic_next_interval(void);
+extern	int		traffic_destination(void);
+extern	int		traffic_payload_length(void);
+
+//  histogram.c
+extern	void		init_histograms(int n);
+extern	void		histogram_add(int which, int64_t value);
+extern	int64_t		histogram_percentile(int which, double pct);
+extern	void		histogram_print(int which, const char *title, double scale, const char *units);
+
+//  wlanmodel.c
+extern	void		init_wlan_model(void);
+extern	double		wlan_path_loss(double metres, double frequency_GHz);
+
+//  mac.c
+typedef	void		(*MAC_SENDER)(int link, void *frame, size_t len, double metres);
+
+extern	void		init_mac(MAC_SENDER sender);
+extern	void		mac_write(int link, void *frame, size_t len, double metres);
+extern	bool		mac_busy(void);
+extern	void		mac_print_stats(void);
+
+//  store.c
+extern	void		init_store(size_t max_bytes);
+extern	int		store_alloc(size_t len);
+extern	void		*store_get(int h);
+extern	size_t		store_length(int h);
+extern	void		store_free(int h);
+extern	int		store_next(int h);
+extern	int		store_count(void);
+extern	size_t		store_bytes(void);
+
+#endif
@@ -0,0 +1,186 @@
+#include <cnet.h>
+#include <cnetsupport.h>
+#include <string.h>
+#include <stdlib.h>
+#include "lab3.h"
+
+//  A CSMA/CA MEDIUM ACCESS LAYER IN FRONT OF EACH NODE'S WLAN LINK
+//
+//  FRAMES ARE QUEUED WITH mac_write(); THE HEAD OF THE QUEUE WAITS A DIFS AND A
+//  RANDOM BACKOFF OF [0,cw) SLOTS, AND THE MEDIUM IS THEN SENSED ONCE (NOT THROUGHOUT
+//  THE WAIT).  IF CNET_carrier_sense() FINDS IT BUSY, THE CONTENTION WINDOW cw DOUBLES
+//  (UP TO CW_MAX) AND WE BACK OFF AGAIN; AFTER MAX_ATTEMPTS THE FRAME IS DROPPED.
+//  WHEN A FRAME IS SENT, cw RETURNS TO CW_MIN.  EVERY EV_FRAMECOLLISION IS COUNTED.
+//
+//	var mac		= "csma" (the default), or "none" to write every frame at once
+//
+//  THE FRAME ITSELF IS WRITTEN BY THE sender GIVEN TO init_mac(), WHICH IS ALSO
+//  PASSED THE metres GIVEN TO mac_write() SO IT CAN SET THE TRANSMIT POWER.
+
+#define	SLOT_TIME		20		// usecs
+#define	DIFS			50		// usecs
+#define	CW_MIN			16		// slots
+#define	CW_MAX			1024		// slots
+#define	MAX_ATTEMPTS		7
+#define	QUEUE_SIZE		32
+#define	MAC_TIMER		EV_TIMER8
+
+//  SHARED COUNTERS OF EVERY NODE, INDICES INTO THE 'm' SEGMENT
+#define	MAC_SENT		0	// frames written to the medium
+#define	MAC_DEFERRED		1	// times the medium was sensed busy, so we backed off
+#define	MAC_DROPPED_BUSY	2	// frames dropped after MAX_ATTEMPTS busy senses
+#define	MAC_DROPPED_FULL	3	// frames dropped because our queue was full (or a copy could not be made)
+#define	MAC_COLLISIONS		4	// EV_FRAMECOLLISIONs, at all receivers
+#define	NMACSTATS		5
+
+typedef struct {
+    int			link;
+    size_t		len;
+    double		metres;		// how far away its receiver is, for the sender
+    void		*frame;
+} QUEUED;
+
+typedef struct {
+    bool		csma;
+    MAC_SENDER		sender;
+    QUEUED		queue[QUEUE_SIZE];
+    int			head;
+    int			nqueued;
+    int			cw;		// current contention window, in slots
+    int			attempts;	// times the head frame has found the medium busy
+    bool		scheduled;	// is an attempt already waiting on MAC_TIMER?
+} MAC;
+
+static	MAC		*mac		= NULL;
+static	int		*macstats	= NULL;
+
+// -----------------------------------------------------------------------
+
+//  WAIT A DIFS, AND THEN A RANDOM NUMBER OF SLOTS FROM THE CURRENT WINDOW
+static void schedule_attempt(CnetTime after)
+{
+    CnetTime	backoff	= DIFS + (CnetTime)(CNET_rand() % mac->cw) * SLOT_TIME;
+
+    CNET_start_timer(MAC_TIMER, after + backoff, 0);
+    mac->scheduled	= true;
+}
+
+static void dequeue(void)
+{
+    free(mac->queue[mac->head].frame);
+    mac->head		= (mac->head + 1) % QUEUE_SIZE;
+    --mac->nqueued;
+    mac->attempts	= 0;
+}
+
+static EVENT_HANDLER(attempt)
+{
+    QUEUED	*q	= &mac->queue[mac->head];
+
+    mac->scheduled	= false;
+    if(mac->nqueued == 0) {
+        return;
+    }
+
+//  SOMEONE ELSE IS TRANSMITTING - WIDEN OUR WINDOW AND TRY AGAIN LATER
+    if(CNET_carrier_sense(q->link) != 0) {
+        ++macstats[MAC_DEFERRED];
+        if(++mac->attempts >= MAX_ATTEMPTS) {
+            ++macstats[MAC_DROPPED_BUSY];
+            dequeue();
+            mac->cw	= CW_MIN;
+        }
+        else if(mac->cw < CW_MAX) {
+            mac->cw	*= 2;
+        }
+        if(mac->nqueued > 0) {
+            schedule_attempt(0);
+        }
+        return;
+    }
+
+//  THE MEDIUM IS OURS; THE NEXT FRAME WAITS UNTIL THIS ONE HAS GONE
+    CnetTime	duration = (CnetTime)(q->len * 8.0 * 1000000.0 / linkinfo[q->link].bandwidth);
+
+    mac->sender(q->link, q->frame, q->len, q->metres);
+    ++macstats[MAC_SENT];
+    dequeue();
+    mac->cw	= CW_MIN;
+    if(mac->nqueued > 0) {
+        schedule_attempt(duration);
+    }
+}
+
+static EVENT_HANDLER(collision)
+{
+    ++macstats[MAC_COLLISIONS];
+}
+
+//  QUEUE A FRAME FOR TRANSMISSION, COPYING IT, SO THE CALLER MAY REUSE ITS BUFFER
+void mac_write(int link, void *frame, size_t len, double metres)
+{
+    if(!mac->csma) {
+        mac->sender(link, frame, len, metres);
+        ++macstats[MAC_SENT];
+        return;
+    }
+    if(mac->nqueued == QUEUE_SIZE) {
+        ++macstats[MAC_DROPPED_FULL];
+        return;
+    }
+    QUEUED	*q	= &mac->queue[(mac->head + mac->nqueued) % QUEUE_SIZE];
+
+    q->frame	= malloc(len);
+    if(q->frame == NULL) {		// no room for the copy, so no room in the queue
+        ++macstats[MAC_DROPPED_FULL];
+        return;
+    }
+    q->link	= link;
+    q->len	= len;
+    q->metres	= metres;
+    memcpy(q->frame, frame, len);
+    ++mac->nqueued;
+
+    if(!mac->scheduled) {
+        schedule_attempt(0);
+    }
+}
+
+//  ARE ANY FRAMES STILL WAITING TO BE SENT?
+bool mac_busy(void)
+{
+    return mac->nqueued > 0;
+}
+
+void mac_print_stats(void)
+{
+    fprintf(stdout, "mac frames sent:\t%d\n", macstats[MAC_SENT]);
+    fprintf(stdout, "mac deferrals:\t\t%d\n", macstats[MAC_DEFERRED]);
+    fprintf(stdout, "mac dropped:\t\t%d busy, %d queue full\n",
+            macstats[MAC_DROPPED_BUSY], macstats[MAC_DROPPED_FULL]);
+    fprintf(stdout, "frame collisions:\t%d", macstats[MAC_COLLISIONS]);
+    if(macstats[MAC_SENT] > 0) {
+        fprintf(stdout, " (%.3f per frame sent)", (double)macstats[MAC_COLLISIONS] / macstats[MAC_SENT]);
+    }
+    fprintf(stdout, "\n");
+}
+
+void init_mac(MAC_SENDER sender)
+{
+    char	*which	= CNET_getvar("mac");
+
+    macstats	= CNET_shmem2("m", NMACSTATS*sizeof(int));
+    if(mac != NULL) {
+        for(int n=0 ; n<mac->nqueued ; ++n) {
+            free(mac->queue[(mac->head + n) % QUEUE_SIZE].frame);
+        }
+        free(mac);
+    }
+    mac		= calloc(1, sizeof(MAC));
+    mac->csma	= (which == NULL || strcmp(which, "none") != 0);
+    mac->sender	= sender;
+    mac->cw	= CW_MIN;
+
+    CHECK(CNET_set_handler(MAC_TIMER, attempt, 0));
+    CHECK(CNET_set_handler(EV_FRAMECOLLISION, collision, 0));
+}
@@ -2,12 +2,40 @@
 #include <cnetsupport.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lab3.h"
 
 #define	EV_MOBILITY		EV_TIMER9
 
-#define	USEC_PER_STEP		10000
+//  POSITIONS ARE CALCULATED FROM THE CURRENT LEG WHENEVER THEY'RE NEEDED,
+//  AND PUSHED TO cnet AT LEAST THIS OFTEN SO THAT SILENT NODES STILL MOVE
+#define	USEC_PER_REFRESH	1000000
 #define	MARGIN			    20
-#define	CLOSE_ENOUGH		100
+
+//  GAUSS-MARKOV: A NEW SPEED AND DIRECTION EVERY GM_INTERVAL, EACH CORRELATED WITH
+//  THE LAST BY GM_ALPHA (0 = RANDOM WALK, 1 = STRAIGHT LINE), TURNING BACK NEAR THE EDGE
+#define	GM_INTERVAL		1000000
+#define	GM_ALPHA		0.75
+#define	GM_EDGE			    (4*MARGIN)
+
+//  MANHATTAN GRID: STREETS EVERY MANHATTAN_BLOCK METRES, AND AT EACH INTERSECTION
+//  GO STRAIGHT ON WITH PROBABILITY 1/2, OR TURN LEFT OR RIGHT WITH 1/4 EACH
+#define	MANHATTAN_BLOCK		100
+
+//  REFERENCE-POINT GROUPS: MEMBERS STAY WITHIN GROUP_RADIUS OF THEIR GROUP'S
+//  REFERENCE POINT, WHICH FOLLOWS ITS OWN RANDOM WAYPOINT WALK
+#define	GROUP_RADIUS		30
+
+//  TRACE REPLAY: A NODE WITH NO MORE MOVEMENT IN ITS TRACE STAYS PUT (NEARLY) FOREVER
+#define	TRACE_FOREVER		((CnetTime)1 << 60)
+#define	TRACE_LINE		256
+
+//  RECORDED LEGS GO TO (AND ARE REPLAYED FROM) ONE BINARY FILE PER NODE, <name>.<nodenumber>
+#define	LEG_FILENAME		"%s.%d"
 
 //  ALL COORDINATES IN METRES
 typedef struct {
@@ -15,98 +43,841 @@ typedef struct {
     double		y;
 } POINT;
 
+//  A NODE IS ALWAYS ON ONE LEG: WALKING STRAIGHT from -> dest, OR PAUSED AT dest
 typedef struct {
-    POINT		now;		// current location
+    POINT		from;		// where this leg began
+    POINT		dest;		// where it ends
+    CnetTime		started;	// when it began
+    CnetTime		arrives;	// when it ends
     bool		paused;		// is this node paused?
-    POINT		dest;		// known destination
-    double		dx;		    // steps to reach destination
-    double		dy;
+    double		speed;		// metres per second along this leg
 
     CnetPosition	maparea;	// max. dimensions of map
     double		walkspeed;	    // metres per second
     CnetTime		pausetime;	// microseconds
     CnetRandom		mt;		    // random state per node
+
+    //  GAUSS-MARKOV
+    double		heading;	// radians
+    double		mean_heading;
+
+    //  MANHATTAN GRID (THE DIRECTION WE'RE WALKING ALONG OUR STREET)
+    int			dirx;
+    int			diry;
+
+    //  REFERENCE-POINT GROUPS - EVERY MEMBER OF A GROUP GENERATES THE SAME
+    //  REFERENCE WALK FROM THE SAME RANDOM SEQUENCE, SO NOTHING NEEDS SHARING
+    CnetRandom		group_mt;
+    POINT		ref_dest;	// where the reference point is heading
+    CnetTime		ref_arrives;	// and when it gets there
+    bool		ref_paused;
 } WALK;
 
+//  A TRACE FILE IS MAPPED INTO MEMORY, NOT READ, AND EACH NODE KEEPS ITS OWN
+//  CURSOR INTO IT, PARSING ONLY ITS OWN RECORDS AND ONLY WHEN IT NEEDS THEM
+typedef struct {
+    const char		*base;		// the whole file
+    const char		*end;
+    const char		*cursor;	// where our next record starts
+    bool		ns2;		// ns-2 setdest format, otherwise BonnMotion
+    char		tag[32];	// "$node_(N)", how our ns-2 lines are marked
+
+    //  ns-2 ONLY - OUR LINES ARE offsets[first_record .. last_record) OF THE SHARED INDEX
+    const long		*offsets;
+    int			first_record;
+    int			last_record;
+    int			next_record;
+
+    //  ns-2 ONLY - THE NEXT setdest, READ AHEAD IN CASE IT CUTS SHORT THE CURRENT ONE
+    bool		pending;
+    CnetTime		pending_at;
+    POINT		pending_dest;
+    double		pending_speed;
+} TRACE;
+
+//  ns-2 TRACES INTERLEAVE EVERY NODE'S LINES, SO THE FIRST NODE TO READ ONE INDEXES
+//  THE LINES NAMING EACH NODE, IN SHARED MEMORY, AND NO NODE READS ANOTHER'S LINES.
+//  SEGMENT 'T' HOLDS first[nnodes+1], AND NODE N'S LINES START AT THE OFFSETS
+//  offsets[first[N] .. first[N+1]) IN SEGMENT 'O'
+typedef struct {
+    bool		built;
+    int			nnodes;		// one more than the highest node number named
+    int			nrecords;	// lines naming a node
+} TRACE_INDEX;
+
+//  EACH MOBILITY MODEL PLACES A NODE ON THE MAP, AND THEN CHOOSES EACH NEW LEG
+//  (WITH walk_to OR pause_for) WHENEVER THE PREVIOUS ONE ENDS
+typedef struct {
+    const char		*name;		// as given by  var mobility  in the topology file
+    void		(*start)(void);
+    void		(*next_leg)(void);
+} MOBILITY_MODEL;
+
 static	WALK		*walk		= NULL;
 static	CnetPosition	*positions	= NULL;
+//  ONE FIXED-SIZE RECORD PER LEG, WRITTEN AS EACH LEG BEGINS - THE FIRST IS OUR
+//  STARTING POINT, AND EACH LATER LEG STARTS WHERE AND WHEN THE ONE BEFORE IT ENDED
+typedef struct {
+    int64_t		arrives;	// microseconds
+    double		x;		// where the leg ends
+    double		y;
+    int32_t		paused;
+    int32_t		unused;
+} LEG_RECORD;
+
+static	const MOBILITY_MODEL	*model	= NULL;
+static	TRACE		*trace		= NULL;
+static	FILE		*recording	= NULL;	// writing our legs as they're chosen
+static	FILE		*replaying	= NULL;	// or reading them back
 
 // -----------------------------------------------------------------------
 
-static void random_point(POINT *new)
+static void random_point(CnetRandom mt, POINT *new)
 {
-    new->x = CNET_nextrand(walk->mt) % (long)(walk->maparea.x-2*MARGIN) + MARGIN;
-    new->y = CNET_nextrand(walk->mt) % (long)(walk->maparea.y-2*MARGIN) + MARGIN;
+    new->x = CNET_nextrand(mt) % (long)(walk->maparea.x-2*MARGIN) + MARGIN;
+    new->y = CNET_nextrand(mt) % (long)(walk->maparea.y-2*MARGIN) + MARGIN;
 }
 
-static EVENT_HANDLER(mobility)
+//  THE SAME  var seed  IN THE TOPOLOGY FILE GIVES THE SAME RANDOM WALKS EVERY RUN
+unsigned int mobility_seed(void)
+{
+    char	*value	= CNET_getvar("seed");
+
+    if(value == NULL || *value == '\0') {
+        return nodeinfo.time_of_day.sec;
+    }
+    return (unsigned int)atol(value);
+}
+
+//  A UNIFORM RANDOM NUMBER IN [0,1), AND A STANDARD NORMAL ONE (BOX-MULLER)
+static double uniform(CnetRandom mt)
 {
-    //  FINISHED PAUSING, BEGIN MOVING TO A NEW DESTINATION
-    if(walk->paused) {
-        POINT		newdest;	//  CHOOSE A NEW RANDOM DESTINATION
+    return (CNET_nextrand(mt) % 1000000) / 1000000.0;
+}
 
-        do {
-            random_point(&newdest);
-        } 
-        while((int)newdest.x == (int)walk->now.x && (int)newdest.y == (int)walk->now.y);
+static double gaussian(CnetRandom mt)
+{
+    double u1	= 1.0 - uniform(mt);	// never 0
+    double u2	= uniform(mt);
 
-        walk->dest	= newdest;
+    return sqrt(-2.0*log(u1)) * cos(2*M_PI*u2);
+}
 
-        //  DETERMINE EACH STEP'S dx AND dy TOWARDS NEW DESTINATION
-        double dx	= (walk->dest.x - walk->now.x);
-        double dy	= (walk->dest.y - walk->now.y);
-        double metres	= sqrt(dx*dx + dy*dy);
-        double nsteps	= (metres / walk->walkspeed)*1000000 / USEC_PER_STEP;
+//  KEEP A POINT INSIDE THE MAP'S MARGINS
+static void clamp_point(POINT *p)
+{
+    p->x	= fmax(MARGIN, fmin(p->x, walk->maparea.x-MARGIN));
+    p->y	= fmax(MARGIN, fmin(p->y, walk->maparea.y-MARGIN));
+}
 
-        walk->dx	= dx / nsteps;
-        walk->dy	= dy / nsteps;
+//  THE NEXT LEG WALKS STRAIGHT FROM WHERE WE ARE TO dest, AT speed
+static void walk_to(POINT dest, double speed)
+{
+    double dx	= (dest.x - walk->from.x);
+    double dy	= (dest.y - walk->from.y);
+    double metres	= sqrt(dx*dx + dy*dy);
 
-        CNET_start_timer(EV_MOBILITY, USEC_PER_STEP, 0);
-        walk->paused	= false;
+    walk->dest	= dest;
+    walk->speed	= speed;
+    walk->arrives	= walk->started + (CnetTime)(metres / speed * 1000000);
+    walk->paused	= false;
+}
+
+//  OR STAYS WHERE WE ARE FOR A WHILE
+static void pause_for(CnetTime usecs)
+{
+    walk->dest	= walk->from;
+    walk->speed	= 0;
+    walk->arrives	= walk->started + usecs;
+    walk->paused	= true;
+}
+
+//  WHERE ARE WE NOW?  A STRAIGHT-LINE INTERPOLATION ALONG THE CURRENT LEG
+static void position_now(POINT *now)
+{
+    CnetTime	elapsed	= nodeinfo.time_in_usec - walk->started;
+    CnetTime	length	= walk->arrives - walk->started;
+
+    if(walk->paused || elapsed >= length) {
+        *now	= walk->dest;
+        return;
+    }
+    double fraction	= (double)elapsed / length;
+
+    now->x	= walk->from.x + fraction*(walk->dest.x - walk->from.x);
+    now->y	= walk->from.y + fraction*(walk->dest.y - walk->from.y);
+}
+
+//  BRING cnet'S IDEA OF OUR POSITION UP TO DATE, CALLED BEFORE WE SEND OR READ A FRAME
+//  DOES NOTHING ON NODES THAT AREN'T MOBILE
+void mobility_update(void)
+{
+    POINT	now;
+
+    if(walk == NULL) {
+        return;
+    }
+    position_now(&now);
+
+    CnetPosition	newpos = { now.x, now.y, 0 };
+    CHECK(CNET_set_position(newpos));
+    positions[nodeinfo.nodenumber]	= newpos;
+}
+
+//  APPEND OUR CURRENT LEG TO OUR RECORDING, IF WE'RE MAKING ONE
+static void record_leg(void)
+{
+    if(recording != NULL) {
+        LEG_RECORD	leg	= { walk->arrives, walk->dest.x, walk->dest.y, walk->paused, 0 };
+
+        fwrite(&leg, sizeof(leg), 1, recording);
+    }
+}
+
+//  WAKE AT THE END OF THIS LEG, OR SOONER IF WE'RE MOVING AND NEED A REFRESH
+static void schedule_mobility(void)
+{
+    CnetTime	next	= walk->arrives - nodeinfo.time_in_usec;
+
+    if(!walk->paused && next > USEC_PER_REFRESH) {
+        next	= USEC_PER_REFRESH;
+    }
+    CNET_start_timer(EV_MOBILITY, next > 0 ? next : 1, 0);
+}
+
+static EVENT_HANDLER(mobility)
+{
+    //  STILL PART-WAY ALONG THIS LEG, JUST REFRESH OUR POSITION
+    if(nodeinfo.time_in_usec < walk->arrives) {
+        mobility_update();
     }
-    //  STILL MOVING, MOVE TOWARDS OUR DESTINATION
+    //  THIS LEG IS OVER - THE MODEL CHOOSES THE NEXT ONE, STARTING FROM HERE
     else {
-        walk->now.x	+= walk->dx;
-        walk->now.y	+= walk->dy;
+        walk->from	= walk->dest;
+        walk->started	= nodeinfo.time_in_usec;
+        model->next_leg();
+        record_leg();
+        mobility_update();
+    }
+    schedule_mobility();
+}
+
+/* ---------------------------- RANDOM WAYPOINT --------------------------- */
+
+static void waypoint_start(void)
+{
+    random_point(walk->mt, &walk->dest);
+}
+
+//  WALK TO A RANDOM POINT, PAUSE THERE, AND REPEAT
+static void waypoint_next_leg(void)
+{
+    if(!walk->paused) {
+        pause_for(walk->pausetime);
+        return;
+    }
+    POINT		newdest;
+
+    do {
+        random_point(walk->mt, &newdest);
+    }
+    while((int)newdest.x == (int)walk->from.x && (int)newdest.y == (int)walk->from.y);
+    walk_to(newdest, walk->walkspeed);
+}
+
+/* ----------------------------- GAUSS-MARKOV ----------------------------- */
+
+static void gauss_markov_start(void)
+{
+    random_point(walk->mt, &walk->dest);
+    walk->speed		= walk->walkspeed;
+    walk->heading	= uniform(walk->mt) * 2*M_PI;
+    walk->mean_heading	= walk->heading;
+}
+
+//  EACH INTERVAL'S SPEED AND HEADING DRIFT FROM THE LAST TOWARDS THEIR MEANS
+static void gauss_markov_next_leg(void)
+{
+    double root	= sqrt(1 - GM_ALPHA*GM_ALPHA);
+
+    //  NEAR AN EDGE, THE MEAN HEADING TURNS TOWARDS THE MIDDLE OF THE MAP
+    if(walk->from.x < GM_EDGE || walk->from.x > walk->maparea.x-GM_EDGE ||
+       walk->from.y < GM_EDGE || walk->from.y > walk->maparea.y-GM_EDGE) {
+        walk->mean_heading	= atan2(walk->maparea.y/2 - walk->from.y,
+                                walk->maparea.x/2 - walk->from.x);
+    }
+    //  AVERAGE THE SHORT WAY ROUND, NOT ACROSS THE +/-PI DISCONTINUITY
+    while(walk->mean_heading - walk->heading > M_PI) {
+        walk->mean_heading	-= 2*M_PI;
+    }
+    while(walk->mean_heading - walk->heading < -M_PI) {
+        walk->mean_heading	+= 2*M_PI;
+    }
+    double speed	= GM_ALPHA*walk->speed + (1-GM_ALPHA)*walk->walkspeed +
+                    root*(walk->walkspeed/4)*gaussian(walk->mt);
+    walk->heading	= GM_ALPHA*walk->heading + (1-GM_ALPHA)*walk->mean_heading +
+                    root*(M_PI/4)*gaussian(walk->mt);
+    speed		= fmax(speed, walk->walkspeed/10);
+
+    POINT	newdest;
+    double	metres	= speed * GM_INTERVAL / 1000000.0;
+
+    newdest.x	= walk->from.x + metres*cos(walk->heading);
+    newdest.y	= walk->from.y + metres*sin(walk->heading);
+    clamp_point(&newdest);
+    walk_to(newdest, speed);
+
+    //  A LEG SHORTENED BY THE EDGE STILL TAKES THE WHOLE INTERVAL, SO IS WALKED MORE SLOWLY
+    double dx	= (newdest.x - walk->from.x);
+    double dy	= (newdest.y - walk->from.y);
+
+    walk->speed	= sqrt(dx*dx + dy*dy) / (GM_INTERVAL / 1000000.0);
+    walk->arrives	= walk->started + GM_INTERVAL;
+}
+
+/* ---------------------------- MANHATTAN GRID ---------------------------- */
+
+//  IS THIS INTERSECTION ON THE MAP?
+static bool on_grid(double x, double y)
+{
+    return x >= MARGIN && x <= walk->maparea.x-MARGIN &&
+           y >= MARGIN && y <= walk->maparea.y-MARGIN;
+}
+
+static void manhattan_start(void)
+{
+    int	cols	= (walk->maparea.x-2*MARGIN) / MANHATTAN_BLOCK + 1;
+    int	rows	= (walk->maparea.y-2*MARGIN) / MANHATTAN_BLOCK + 1;
+
+    walk->dest.x	= MARGIN + (CNET_nextrand(walk->mt) % cols) * MANHATTAN_BLOCK;
+    walk->dest.y	= MARGIN + (CNET_nextrand(walk->mt) % rows) * MANHATTAN_BLOCK;
+    walk->dirx		= 1;
+    walk->diry		= 0;
+}
+
+//  WALK ONE BLOCK TO THE NEXT INTERSECTION, TURNING AT RANDOM BUT NEVER OFF THE GRID
+static void manhattan_next_leg(void)
+{
+    int		choices[3][2]	= {
+        { walk->dirx, walk->diry },		// straight on
+        { -walk->diry, walk->dirx },		// left
+        { walk->diry, -walk->dirx },		// right
+    };
+    double	r	= uniform(walk->mt);
+    int		first	= (r < 0.5) ? 0 : (r < 0.75) ? 1 : 2;
+
+    for(int c=0 ; c<4 ; ++c) {
+        int	dirx, diry;
+
+        if(c < 3) {
+            dirx	= choices[(first+c) % 3][0];
+            diry	= choices[(first+c) % 3][1];
+        }
+        else {						// a dead end, so turn back
+            dirx	= -walk->dirx;
+            diry	= -walk->diry;
+        }
+        POINT	newdest	= { walk->from.x + dirx*MANHATTAN_BLOCK,
+                            walk->from.y + diry*MANHATTAN_BLOCK };
+
+        if(on_grid(newdest.x, newdest.y)) {
+            walk->dirx	= dirx;
+            walk->diry	= diry;
+            walk_to(newdest, walk->walkspeed);
+            return;
+        }
+    }
+    pause_for(walk->pausetime);			// a grid of one intersection
+}
+
+/* ------------------------ REFERENCE-POINT GROUPS ------------------------ */
+
+//  MOVE THE GROUP'S REFERENCE POINT ALONG ITS WALK UNTIL IT'S ON ITS CURRENT LEG
+static void advance_reference(void)
+{
+    while(walk->ref_arrives <= nodeinfo.time_in_usec) {
+        if(!walk->ref_paused) {
+            walk->ref_arrives	+= walk->pausetime;
+            walk->ref_paused	= true;
+        }
+        else {
+            POINT	from	= walk->ref_dest;
+
+            random_point(walk->group_mt, &walk->ref_dest);
+            double dx	= (walk->ref_dest.x - from.x);
+            double dy	= (walk->ref_dest.y - from.y);
+
+            walk->ref_arrives	+= (CnetTime)(sqrt(dx*dx + dy*dy) / walk->walkspeed * 1000000) + 1;
+            walk->ref_paused	= false;
+        }
+    }
+}
+
+//  OUR OWN SPOT NEAR THE REFERENCE POINT, DIFFERENT FOR EACH OF ITS LEGS
+static void near_reference(POINT *p)
+{
+    double	angle	= uniform(walk->mt) * 2*M_PI;
+    double	radius	= uniform(walk->mt) * GROUP_RADIUS;
+
+    p->x	= walk->ref_dest.x + radius*cos(angle);
+    p->y	= walk->ref_dest.y + radius*sin(angle);
+    clamp_point(p);
+}
+
+static void group_start(void)
+{
+    char	*value	= CNET_getvar("groups");
+    int		ngroups	= (value == NULL || atoi(value) < 1) ? 1 : atoi(value);
+    int		group	= nodeinfo.nodenumber % ngroups;
+
+    //  EVERY MEMBER OF THE SAME GROUP SEEDS ITS REFERENCE WALK IDENTICALLY
+    walk->group_mt	= CNET_newrand(mobility_seed() + 1000*(group+1));
+    random_point(walk->group_mt, &walk->ref_dest);
+    walk->ref_arrives	= nodeinfo.time_in_usec;
+    walk->ref_paused	= true;
+    near_reference(&walk->dest);
+}
+
+//  HEAD FOR OUR SPOT NEAR WHERE THE REFERENCE POINT WILL BE, ARRIVING WHEN IT DOES
+static void group_next_leg(void)
+{
+    advance_reference();
+
+    CnetTime	usecs	= walk->ref_arrives - walk->started;
+    POINT	newdest;
+
+    if(walk->ref_paused) {
+        pause_for(usecs);
+        return;
+    }
+    near_reference(&newdest);
+    double dx	= (newdest.x - walk->from.x);
+    double dy	= (newdest.y - walk->from.y);
+
+    walk_to(newdest, fmax(sqrt(dx*dx + dy*dy) / (usecs / 1000000.0), 0.001));
+    walk->arrives	= walk->ref_arrives;
+}
+
+/* ----------------------------- TRACE REPLAY ----------------------------- */
+
+//  MAP THE WHOLE TRACE FILE INTO MEMORY - PAGES ARE ONLY READ AS NODES REACH THEM
+static void map_trace(const char *filename)
+{
+    struct stat	st;
+    int		fd	= open(filename, O_RDONLY);
+
+    if(fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "cannot read mobility trace '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    void	*base	= mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+    if(base == MAP_FAILED) {
+        fprintf(stderr, "cannot map mobility trace '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    trace	= calloc(1, sizeof(TRACE));
+    trace->base		= base;
+    trace->end		= trace->base + st.st_size;
+    trace->cursor	= trace->base;
+}
+
+//  COPY THE LINE AT THE CURSOR (TRUNCATED IF NEED BE) AND MOVE PAST IT
+static bool next_line(char *line)
+{
+    if(trace->cursor >= trace->end) {
+        return false;
+    }
+    const char	*eol	= memchr(trace->cursor, '\n', trace->end - trace->cursor);
+    size_t	len;
+
+    if(eol == NULL) {
+        eol	= trace->end;
+    }
+    len	= eol - trace->cursor;
+    if(len >= TRACE_LINE) {
+        len	= TRACE_LINE-1;
+    }
+    memcpy(line, trace->cursor, len);
+    line[len]	= '\0';
+    trace->cursor	= (eol < trace->end) ? eol+1 : trace->end;
+    return true;
+}
+
+//  READ THE NEXT NUMBER FROM OUR BonnMotion LINE, STOPPING AT ITS END
+static bool next_number(double *value)
+{
+    char	token[64];
+    int		len	= 0;
+
+    while(trace->cursor < trace->end && (*trace->cursor == ' ' || *trace->cursor == '\t')) {
+        ++trace->cursor;
+    }
+    while(trace->cursor < trace->end && len < (int)sizeof(token)-1 &&
+          *trace->cursor != ' ' && *trace->cursor != '\t' &&
+          *trace->cursor != '\n' && *trace->cursor != '\r') {
+        token[len++]	= *trace->cursor++;
+    }
+    token[len]	= '\0';
+    return len > 0 && sscanf(token, "%lf", value) == 1;
+}
+
+//  THE NODE NUMBER AN ns-2 LINE IS ABOUT, OR -1 IF IT DOESN'T NAME ONE
+static int line_node(const char *line)
+{
+    const char	*tag	= strstr(line, "$node_(");
+    int		n;
+
+    if(tag == NULL || sscanf(tag, "$node_(%d)", &n) != 1 || n < 0) {
+        return -1;
+    }
+    return n;
+}
+
+//  FIND (OR, ON THE FIRST NODE, BUILD) THE SHARED INDEX, AND OUR PART OF IT
+static void index_trace(void)
+{
+    TRACE_INDEX	*index	= CNET_shmem2("t", sizeof(TRACE_INDEX));
+    char	line[TRACE_LINE];
+    int		*counts	= NULL;
+
+//  FIRST PASS: HOW MANY LINES NAME EACH NODE
+    if(!index->built) {
+        trace->cursor	= trace->base;
+        while(next_line(line)) {
+            int		n	= line_node(line);
+
+            if(n < 0) {
+                continue;
+            }
+            if(n >= index->nnodes) {
+                counts	= realloc(counts, (n+1) * sizeof(int));
+                memset(counts + index->nnodes, 0, (n+1 - index->nnodes) * sizeof(int));
+                index->nnodes	= n+1;
+            }
+            ++counts[n];
+            ++index->nrecords;
+        }
+    }
+    int		*first	= CNET_shmem2("T", (index->nnodes+1) * sizeof(int));
+    long	*offsets	= CNET_shmem2("O", (index->nrecords > 0 ? index->nrecords : 1) * sizeof(long));
+
+//  SECOND PASS: WHERE EACH OF THOSE LINES STARTS, GROUPED BY NODE
+    if(!index->built) {
+        first[0]	= 0;
+        for(int n=0 ; n<index->nnodes ; ++n) {
+            first[n+1]	= first[n] + counts[n];
+            counts[n]	= first[n];
+        }
+        trace->cursor	= trace->base;
+        while(trace->cursor < trace->end) {
+            long	at	= trace->cursor - trace->base;
+
+            next_line(line);
+            int		n	= line_node(line);
+
+            if(n >= 0) {
+                offsets[counts[n]++]	= at;
+            }
+        }
+        free(counts);
+        index->built	= true;
+    }
+
+    trace->offsets	= offsets;
+    if(nodeinfo.nodenumber < index->nnodes) {
+        trace->first_record	= first[nodeinfo.nodenumber];
+        trace->last_record	= first[nodeinfo.nodenumber+1];
+    }
+    trace->next_record	= trace->first_record;
+}
+
+//  COPY OUR NEXT INDEXED ns-2 LINE
+static bool next_record(char *line)
+{
+    if(trace->next_record >= trace->last_record) {
+        return false;
+    }
+    trace->cursor	= trace->base + trace->offsets[trace->next_record++];
+    return next_line(line);
+}
+
+//  FIND OUR NEXT ns-2 setdest, AMONG THE LINES INDEXED AS OURS
+static void read_setdest(void)
+{
+    char	line[TRACE_LINE];
+    double	at, x, y, speed;
+
+    trace->pending	= false;
+    while(next_record(line)) {
+        char	*ours	= strstr(line, trace->tag);
+
+        if(ours != NULL &&
+           sscanf(line, " $ns_ at %lf", &at) == 1 &&
+           sscanf(ours + strlen(trace->tag), " setdest %lf %lf %lf", &x, &y, &speed) == 3) {
+            trace->pending	= true;
+            trace->pending_at	= (CnetTime)(at * 1000000);
+            trace->pending_dest.x	= x;
+            trace->pending_dest.y	= y;
+            trace->pending_speed	= speed;
+            return;
+        }
+    }
+}
+
+//  THE TRACE TO REPLAY IS NAMED WITH  var trace = "..."  IN THE TOPOLOGY FILE,
+//  AND NODE NUMBER N FOLLOWS THE TRACE'S NODE N
+static void trace_start(void)
+{
+    char	*filename	= CNET_getvar("trace");
+    char	line[TRACE_LINE];
+    double	value;
+
+    if(filename == NULL) {
+        fprintf(stderr, "var mobility = \"trace\" needs a var trace = \"filename\"\n");
+        exit(EXIT_FAILURE);
+    }
+    map_trace(filename);
+    sprintf(trace->tag, "$node_(%d)", nodeinfo.nodenumber);
+
+    //  ns-2 TRACES ARE TCL, SO START WITH '$' (OR A '#' COMMENT); BonnMotion'S WITH A NUMBER
+    trace->ns2	= (*trace->base == '$' || *trace->base == '#');
 
-        CnetPosition	newpos = { walk->now.x, walk->now.y, 0 };
-        CHECK(CNET_set_position(newpos));
-        positions[nodeinfo.nodenumber]	= newpos;
+    //  ns-2: OUR INITIAL POSITION IS SET BEFORE ANY MOVEMENT, THEN READ OUR FIRST setdest
+    if(trace->ns2) {
+        bool	moving	= false;
 
-        //  ARE WE THERE YET?  ARE WE THERE YET?  ARE WE THERE YET?
-        double dx	= (walk->dest.x - walk->now.x);
-        double dy	= (walk->dest.y - walk->now.y);
+        index_trace();
+        while(!moving && next_record(line)) {
+            char	*ours	= strstr(line, trace->tag);
 
-        if((dx*dx + dy*dy) <= CLOSE_ENOUGH) {
-            walk->paused	= true;
-            CNET_start_timer(EV_MOBILITY, walk->pausetime, 0);	// pause
+            if(ours == NULL) {
+                continue;
+            }
+            if(sscanf(ours + strlen(trace->tag), " set X_ %lf", &value) == 1) {
+                walk->dest.x	= value;
+            }
+            else if(sscanf(ours + strlen(trace->tag), " set Y_ %lf", &value) == 1) {
+                walk->dest.y	= value;
+            }
+            else if(strstr(line, "$ns_ at") != NULL) {
+                moving	= true;
+            }
         }
-        else{
-            CNET_start_timer(EV_MOBILITY, USEC_PER_STEP, 0);	// keep walking
+        trace->next_record	= trace->first_record;
+        read_setdest();
+    }
+    //  BonnMotion: LINE N HOLDS NODE N'S "time x y" WAYPOINTS, SO SKIP TO OURS
+    else {
+        for(int n=0 ; n<nodeinfo.nodenumber && trace->cursor < trace->end ; ++n) {
+            const char	*eol	= memchr(trace->cursor, '\n', trace->end - trace->cursor);
+
+            trace->cursor	= (eol == NULL) ? trace->end : eol+1;
+        }
+        if(!next_number(&value) || !next_number(&walk->dest.x) || !next_number(&walk->dest.y)) {
+            fprintf(stderr, "mobility trace has no waypoints for node %d\n", nodeinfo.nodenumber);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+//  GET FROM HERE TO dest BY THE TIME arrives, OR JUST WAIT IF WE'RE ALREADY THERE
+static void trace_leg(POINT dest, CnetTime arrives)
+{
+    CnetTime	usecs	= arrives - walk->started;
+
+    if(usecs < 1) {
+        usecs	= 1;
+    }
+    if(dest.x == walk->from.x && dest.y == walk->from.y) {
+        pause_for(usecs);
+        return;
+    }
+    double dx	= (dest.x - walk->from.x);
+    double dy	= (dest.y - walk->from.y);
+
+    walk_to(dest, sqrt(dx*dx + dy*dy) / (usecs / 1000000.0));
+    walk->arrives	= walk->started + usecs;
+}
+
+static void trace_next_leg(void)
+{
+    double	at;
+    POINT	dest;
+
+    //  BonnMotion: WALK TO OUR NEXT WAYPOINT, ARRIVING AT ITS TIME
+    if(!trace->ns2) {
+        if(!next_number(&at) || !next_number(&dest.x) || !next_number(&dest.y)) {
+            pause_for(TRACE_FOREVER);
+            return;
         }
+        trace_leg(dest, (CnetTime)(at * 1000000));
+        return;
+    }
+
+    //  ns-2: WAIT FOR OUR NEXT setdest, OR FOLLOW IT NOW
+    if(!trace->pending) {
+        pause_for(TRACE_FOREVER);
+        return;
+    }
+    if(trace->pending_at > walk->started) {
+        pause_for(trace->pending_at - walk->started);
+        return;
+    }
+    dest	= trace->pending_dest;
+    double speed	= trace->pending_speed;
+
+    read_setdest();
+    if(speed <= 0) {
+        pause_for(trace->pending ? trace->pending_at - walk->started : TRACE_FOREVER);
+        return;
+    }
+    walk_to(dest, speed);
+
+    //  A LATER setdest ARRIVING BEFORE WE DO TAKES OVER FROM WHEREVER WE'VE GOT TO
+    if(trace->pending && trace->pending_at < walk->arrives) {
+        CnetTime	cut	= trace->pending_at > walk->started ? trace->pending_at : walk->started+1;
+        double		fraction	= (double)(cut - walk->started) / (walk->arrives - walk->started);
+
+        dest.x	= walk->from.x + fraction*(walk->dest.x - walk->from.x);
+        dest.y	= walk->from.y + fraction*(walk->dest.y - walk->from.y);
+        walk->dest	= dest;
+        walk->arrives	= cut;
+    }
+}
+
+/* ---------------------------- RECORDED LEGS ----------------------------- */
+
+//  THE OTHER HALF OF record_leg - var trace NAMES WHAT  var record  ONCE WROTE
+static void replay_start(void)
+{
+    char	*name	= CNET_getvar("trace");
+    char	filename[256];
+    LEG_RECORD	leg;
+
+    if(name == NULL) {
+        fprintf(stderr, "var mobility = \"replay\" needs a var trace = \"name\"\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(filename, sizeof(filename), LEG_FILENAME, name, nodeinfo.nodenumber);
+    replaying	= fopen(filename, "rb");
+    if(replaying == NULL || fread(&leg, sizeof(leg), 1, replaying) != 1) {
+        fprintf(stderr, "cannot replay legs from '%s'\n", filename);
+        exit(EXIT_FAILURE);
     }
+    walk->dest.x	= leg.x;
+    walk->dest.y	= leg.y;
 }
 
+//  EXACTLY THE LEG WE TOOK LAST TIME, AT EXACTLY THE SAME SPEED
+static void replay_next_leg(void)
+{
+    LEG_RECORD	leg;
+
+    if(fread(&leg, sizeof(leg), 1, replaying) != 1) {
+        pause_for(TRACE_FOREVER);
+        return;
+    }
+    walk->dest.x	= leg.x;
+    walk->dest.y	= leg.y;
+    walk->arrives	= leg.arrives;
+    walk->paused	= leg.paused;
+    walk->speed		= 0;
+    if(!walk->paused && walk->arrives > walk->started) {
+        double dx	= (walk->dest.x - walk->from.x);
+        double dy	= (walk->dest.y - walk->from.y);
+
+        walk->speed	= sqrt(dx*dx + dy*dy) / ((walk->arrives - walk->started) / 1000000.0);
+    }
+}
+
+// -----------------------------------------------------------------------
+
+static const MOBILITY_MODEL	models[] = {
+    { "waypoint",	waypoint_start,		waypoint_next_leg	},
+    { "gauss-markov",	gauss_markov_start,	gauss_markov_next_leg	},
+    { "manhattan",	manhattan_start,	manhattan_next_leg	},
+    { "group",		group_start,		group_next_leg		},
+    { "trace",		trace_start,		trace_next_leg		},
+    { "replay",		replay_start,		replay_next_leg		},
+};
+#define	NMODELS		((int)(sizeof(models) / sizeof(models[0])))
+
+//  REPORT WHERE WE'RE WALKING TO, AND HOW FAST (false WHILE PAUSED)
+bool mobility_heading(CnetPosition *dest, double *speed_metres_per_sec)
+{
+    if(walk == NULL || walk->paused) {
+        return false;
+    }
+    dest->x	= walk->dest.x;
+    dest->y	= walk->dest.y;
+    dest->z	= 0;
+    *speed_metres_per_sec	= walk->speed;
+    return true;
+}
+
+//  FLUSH AND CLOSE ANY RECORDING (OR REPLAY), WHEN THE SIMULATION ENDS
+void mobility_finish(void)
+{
+    if(recording != NULL) {
+        fclose(recording);
+        recording	= NULL;
+    }
+    if(replaying != NULL) {
+        fclose(replaying);
+        replaying	= NULL;
+    }
+}
+
+//  THE MODEL IS CHOSEN WITH  var mobility = "gauss-markov", "manhattan", "group",
+//  "trace" OR "replay" IN THE TOPOLOGY FILE, AND IS RANDOM WAYPOINT OTHERWISE
+//  var record = "name"  ALSO WRITES EVERY LEG TAKEN, TO BE REPLAYED LATER
 void init_mobility(double walkspeed_metres_per_sec, int pausetime_secs, int nnodes)
 {
+    char	*name	= CNET_getvar("mobility");
+
+    mobility_finish();
+    model	= &models[0];
+    for(int m=0 ; name != NULL && m<NMODELS ; ++m) {
+        if(strcmp(name, models[m].name) == 0) {
+            model	= &models[m];
+        }
+    }
+
     //  ALLOCATE AND INITIALIZE A NEW WALK STRUCTURE
     walk		= calloc(1, sizeof(WALK));
     walk->walkspeed	= walkspeed_metres_per_sec;
     walk->pausetime	= pausetime_secs * 1000000;
-    walk->paused	= true;
     CHECK(CNET_get_position(NULL, &walk->maparea));
     walk->mt		=
-		CNET_newrand(nodeinfo.time_of_day.sec + nodeinfo.nodenumber);
+		CNET_newrand(mobility_seed() + nodeinfo.nodenumber);
 
     positions	= CNET_shmem2("p", nnodes*sizeof(CnetPosition));
 
-    //  CHOOSE OUR RANDOM STARTING POINT ON THE MAP
-    random_point(&walk->now);
-    CnetPosition	newpos = { walk->now.x, walk->now.y, 0 };
-    CHECK(CNET_set_position(newpos));
-    positions[nodeinfo.nodenumber]	= newpos;
+    //  THE MODEL CHOOSES OUR STARTING POINT ON THE MAP, AND WE 'PAUSE' THERE UNTIL NOW
+    model->start();
+    walk->from		= walk->dest;
+    walk->started	= nodeinfo.time_in_usec;
+    walk->arrives	= nodeinfo.time_in_usec;
+    walk->paused	= true;
+    mobility_update();
+
+    //  RECORDING?  OUR STARTING POINT IS THE FIRST LEG
+    char	*record	= CNET_getvar("record");
+    if(record != NULL && *record != '\0') {
+        char	filename[256];
+
+        snprintf(filename, sizeof(filename), LEG_FILENAME, record, nodeinfo.nodenumber);
+        recording	= fopen(filename, "wb");
+        if(recording == NULL) {
+            fprintf(stderr, "cannot record legs to '%s'\n", filename);
+            exit(EXIT_FAILURE);
+        }
+        record_leg();
+    }
 
     //  AND START MOVING
     CHECK(CNET_set_handler(EV_MOBILITY, mobility, 0));
-    CNET_start_timer(EV_MOBILITY, USEC_PER_STEP, 0);
+    schedule_mobility();
 }
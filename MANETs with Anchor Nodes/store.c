@@ -0,0 +1,186 @@
+#include <cnet.h>
+#include <cnetsupport.h>
+#include <string.h>
+#include <stdlib.h>
+#include "lab3.h"
+
+//  A COMPACT STORE FOR VARIABLE-LENGTH MESSAGES, SO A NODE KEEPS ONLY THE BYTES
+//  EACH ONE NEEDS.  SPACE COMES FROM SLABS OF SLAB_SIZE BYTES, EACH CARVED INTO
+//  CHUNKS OF ONE SIZE CLASS (A POWER OF TWO FROM MIN_CHUNK UP TO SLAB_SIZE), AND
+//  FREED CHUNKS GO BACK ON THEIR CLASS'S FREE LIST.  A STORED MESSAGE IS NAMED BY
+//  AN INTEGER HANDLE, WHICH STAYS VALID UNTIL store_free() IS CALLED ON IT.
+
+#define	MIN_CHUNK		32
+#define	SLAB_SIZE		4096
+#define	NCLASSES		8		// 32, 64, ... 4096
+#define	MAX_HANDLES		8192
+
+typedef struct _chunk {
+    struct _chunk	*next;		// only while it's on a free list
+} CHUNK;
+
+typedef struct {
+    void		*data;		// NULL if this handle is unused
+    size_t		len;
+    int			class;
+    int			next_free;	// next unused handle, while this one is unused
+} ITEM;
+
+typedef struct {
+    size_t		max_slabs;
+    size_t		nslabs;
+    void		**slabs;	// every slab we've allocated, to free them on a reboot
+    CHUNK		*free_chunks[NCLASSES];
+    ITEM		items[MAX_HANDLES];
+    int			first_free;
+    int			high;		// no handle at or above this has been used
+    int			nitems;
+    size_t		bytes;		// bytes of messages stored, not of chunks
+} STORE;
+
+static	STORE		*store	= NULL;
+
+// -----------------------------------------------------------------------
+
+//  THE SMALLEST CLASS WITH CHUNKS OF AT LEAST len BYTES, OR -1 IF TOO LONG
+static int class_of(size_t len)
+{
+    size_t	chunk	= MIN_CHUNK;
+
+    for(int c=0 ; c<NCLASSES ; ++c) {
+        if(len <= chunk) {
+            return c;
+        }
+        chunk	*= 2;
+    }
+    return -1;
+}
+
+//  CARVE A NEW SLAB INTO CHUNKS OF ONE CLASS, IF WE'RE STILL ALLOWED ANOTHER
+//  (AND CAN GET THE MEMORY FOR IT)
+static bool grow(int class)
+{
+    size_t	chunk	= (size_t)MIN_CHUNK << class;
+
+    if(store->nslabs == store->max_slabs) {
+        return false;
+    }
+    char	*slab	= malloc(SLAB_SIZE);
+    void	**slabs	= realloc(store->slabs, (store->nslabs+1) * sizeof(void *));
+
+    if(slab == NULL || slabs == NULL) {
+        free(slab);
+        if(slabs != NULL) {
+            store->slabs	= slabs;
+        }
+        return false;
+    }
+    store->slabs	= slabs;
+    store->slabs[store->nslabs++]	= slab;
+    for(size_t off=0 ; off + chunk <= SLAB_SIZE ; off += chunk) {
+        CHUNK	*c	= (CHUNK *)(slab + off);
+
+        c->next				= store->free_chunks[class];
+        store->free_chunks[class]	= c;
+    }
+    return true;
+}
+
+//  MAKE ROOM FOR len BYTES, FILLED IN THROUGH store_get(), RETURNING THEIR HANDLE
+//  OR -1 IF THERE'S NO ROOM
+int store_alloc(size_t len)
+{
+    int		class	= class_of(len);
+
+    if(class < 0 || store->first_free < 0) {
+        return -1;
+    }
+    if(store->free_chunks[class] == NULL && !grow(class)) {
+        return -1;
+    }
+    CHUNK	*c	= store->free_chunks[class];
+    int		h	= store->first_free;
+    ITEM	*item	= &store->items[h];
+
+    store->free_chunks[class]	= c->next;
+    store->first_free		= item->next_free;
+    item->data			= c;
+    item->len			= len;
+    item->class			= class;
+    if(h >= store->high) {
+        store->high		= h+1;
+    }
+    ++store->nitems;
+    store->bytes		+= len;
+    return h;
+}
+
+void *store_get(int h)
+{
+    return store->items[h].data;
+}
+
+size_t store_length(int h)
+{
+    return store->items[h].len;
+}
+
+void store_free(int h)
+{
+    ITEM	*item	= &store->items[h];
+    CHUNK	*c	= item->data;
+
+    if(c == NULL) {
+        return;
+    }
+    c->next				= store->free_chunks[item->class];
+    store->free_chunks[item->class]	= c;
+    store->bytes		-= item->len;
+    --store->nitems;
+    item->data			= NULL;
+    item->next_free		= store->first_free;
+    store->first_free		= h;
+}
+
+//  THE NEXT HANDLE IN USE AFTER h (START WITH -1), OR -1 WHEN THERE ARE NO MORE
+//  FREEING h ITSELF WHILE ITERATING IS SAFE
+int store_next(int h)
+{
+    for(++h ; h<store->high ; ++h) {
+        if(store->items[h].data != NULL) {
+            return h;
+        }
+    }
+    return -1;
+}
+
+int store_count(void)
+{
+    return store->nitems;
+}
+
+size_t store_bytes(void)
+{
+    return store->bytes;
+}
+
+//  AN EMPTY STORE THAT MAY GROW TO max_bytes OF SLABS (AT LEAST ONE)
+void init_store(size_t max_bytes)
+{
+    if(store != NULL) {
+        for(size_t s=0 ; s<store->nslabs ; ++s) {
+            free(store->slabs[s]);
+        }
+        free(store->slabs);
+        free(store);
+    }
+    store	= calloc(1, sizeof(STORE));
+    store->max_slabs	= max_bytes / SLAB_SIZE;
+    if(store->max_slabs == 0) {
+        store->max_slabs	= 1;
+    }
+    for(int h=0 ; h<MAX_HANDLES ; ++h) {
+        store->items[h].next_free	= (h+1 < MAX_HANDLES) ? h+1 : -1;
+    }
+    store->first_free	= 0;
+}
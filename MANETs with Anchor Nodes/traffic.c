@@ -0,0 +1,151 @@
+#include <cnet.h>
+#include <cnetsupport.h>
+#include <string.h>
+#include <stdlib.h>
+#include "lab3.h"
+
+//  HOW A MOBILE DECIDES WHEN TO SEND ITS NEXT MESSAGE, TO WHOM, AND HOW LONG
+//  IT IS - CHOSEN WITH THESE TOPOLOGY FILE VARIABLES (DEFAULTS IN BRACKETS):
+//
+//	var traffic	= "uniform" (every 5-10s), "cbr", "poisson", "onoff" or "hotspot"
+//	var rate	= messages per second for cbr, poisson, onoff and hotspot [1]
+//	var payload	= payload bytes, either "N" or "MIN-MAX" [just "hello"]
+//	var on, off	= mean seconds of each on and off period, for onoff [5, 15]
+//	var hotspot	= the address that hotspot traffic favours [the first mobile]
+//	var hotshare	= percentage of hotspot messages sent to it [50]
+
+#define	UNIFORM_MIN		5000000
+#define	UNIFORM_MAX		10000000
+
+typedef enum { TR_UNIFORM, TR_CBR, TR_POISSON, TR_ONOFF, TR_HOTSPOT } TRAFFIC_MODEL;
+
+typedef struct {
+    TRAFFIC_MODEL	model;
+    double		rate;		// messages per second
+    int			minpayload;	// 0 means just the "hello" text
+    int			maxpayload;
+
+    double		on_secs;	// mean on and off periods for TR_ONOFF
+    double		off_secs;
+    CnetTime		on_until;	// when the current on period ends
+
+    int			hotspot;
+    int			hotshare;	// percent
+
+    //  EVERY OTHER MOBILE'S ADDRESS, SO A DESTINATION IS A SINGLE RANDOM INDEX
+    int			*others;
+    int			nothers;
+} TRAFFIC;
+
+static	TRAFFIC		*traffic	= NULL;
+
+// -----------------------------------------------------------------------
+
+//  A UNIFORM RANDOM NUMBER IN [0,1)
+static double uniform(void)
+{
+    return (CNET_rand() % 1000000) / 1000000.0;
+}
+
+//  AN EXPONENTIALLY DISTRIBUTED NUMBER OF MICROSECONDS, WITH THE GIVEN MEAN
+static CnetTime exponential(double mean_secs)
+{
+    return (CnetTime)(-mean_secs * log(1.0 - uniform()) * 1000000) + 1;
+}
+
+//  HOW LONG UNTIL OUR NEXT MESSAGE?
+CnetTime traffic_next_interval(void)
+{
+    CnetTime	interval;
+
+    switch (traffic->model) {
+    case TR_UNIFORM:
+        return UNIFORM_MIN + CNET_rand() % (UNIFORM_MAX - UNIFORM_MIN);
+
+    case TR_CBR:
+        return (CnetTime)(1000000 / traffic->rate);
+
+    case TR_POISSON:
+    case TR_HOTSPOT:
+        return exponential(1.0 / traffic->rate);
+
+    case TR_ONOFF:
+    //  SEND AT A CONSTANT RATE WHILE ON; IF THE NEXT MESSAGE WOULD FALL IN AN
+    //  OFF PERIOD, WAIT IT OUT AND SEND THE FIRST MESSAGE OF THE NEXT BURST
+        interval	= (CnetTime)(1000000 / traffic->rate);
+        if(nodeinfo.time_in_usec + interval <= traffic->on_until) {
+            return interval;
+        }
+        interval	= (traffic->on_until > nodeinfo.time_in_usec ?
+                            traffic->on_until - nodeinfo.time_in_usec : 0) +
+                            exponential(traffic->off_secs);
+        traffic->on_until	= nodeinfo.time_in_usec + interval + exponential(traffic->on_secs);
+        return interval;
+    }
+    return UNIFORM_MAX;
+}
+
+//  WHO'S OUR NEXT MESSAGE FOR?  0 IF THERE'S NO OTHER MOBILE
+int traffic_destination(void)
+{
+    if(traffic->nothers == 0) {
+        return 0;
+    }
+    if(traffic->model == TR_HOTSPOT && traffic->hotspot != nodeinfo.address &&
+       CNET_rand() % 100 < traffic->hotshare) {
+        return traffic->hotspot;
+    }
+    return traffic->others[CNET_rand() % traffic->nothers];
+}
+
+//  HOW MANY BYTES SHOULD OUR NEXT PAYLOAD BE?  0 FOR JUST THE "hello" TEXT
+int traffic_payload_length(void)
+{
+    if(traffic->maxpayload <= traffic->minpayload) {
+        return traffic->minpayload;
+    }
+    return traffic->minpayload + CNET_rand() % (traffic->maxpayload - traffic->minpayload + 1);
+}
+
+void init_traffic(const int *mobiles, int nmobiles)
+{
+    char	*model	= CNET_getvar("traffic");
+    char	*payload	= CNET_getvar("payload");
+
+    traffic		= calloc(1, sizeof(TRAFFIC));
+    traffic->model	= TR_UNIFORM;
+    if(model != NULL) {
+        if(strcmp(model, "cbr") == 0)
+            traffic->model	= TR_CBR;
+        else if(strcmp(model, "poisson") == 0)
+            traffic->model	= TR_POISSON;
+        else if(strcmp(model, "onoff") == 0)
+            traffic->model	= TR_ONOFF;
+        else if(strcmp(model, "hotspot") == 0)
+            traffic->model	= TR_HOTSPOT;
+    }
+
+    traffic->rate	= getvar_double("rate", 1.0);
+    if(traffic->rate <= 0) {
+        traffic->rate	= 1.0;
+    }
+    traffic->on_secs	= getvar_double("on", 5.0);
+    traffic->off_secs	= getvar_double("off", 15.0);
+    traffic->on_until	= nodeinfo.time_in_usec + exponential(traffic->on_secs);
+    traffic->hotspot	= (int)getvar_double("hotspot", nmobiles > 0 ? mobiles[0] : 0);
+    traffic->hotshare	= (int)getvar_double("hotshare", 50);
+
+    if(payload != NULL && *payload != '\0') {
+        if(sscanf(payload, "%d-%d", &traffic->minpayload, &traffic->maxpayload) != 2) {
+            traffic->maxpayload	= traffic->minpayload;
+        }
+    }
+
+    //  EVERYONE BUT US
+    traffic->others	= calloc(nmobiles > 0 ? nmobiles : 1, sizeof(int));
+    for(int m=0 ; m<nmobiles ; ++m) {
+        if(mobiles[m] != nodeinfo.address && mobiles[m] != 0) {
+            traffic->others[traffic->nothers++]	= mobiles[m];
+        }
+    }
+}
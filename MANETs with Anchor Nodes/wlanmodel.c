@@ -0,0 +1,170 @@
+#include <cnet.h>
+#include <cnetsupport.h>
+#include <string.h>
+#include <stdlib.h>
+#include "lab3.h"
+
+//  A FAST WLAN PROPAGATION MODEL, REPLACING cnet'S OWN WITH  var propagation = "fast"
+//
+//  PATH LOSS FOLLOWS THE LOG-DISTANCE MODEL, FREE-SPACE LOSS UP TO d0 AND THEN
+//	PL(d) = PL(d0) + 10 n log10(d/d0)
+//  PLUS A FIXED LOG-NORMAL SHADOWING TERM FOR EACH PAIR OF NODES.  PATH LOSS IS
+//  LOOKED UP IN A TABLE INDEXED BY SQUARED DISTANCE (SO NO sqrt OR log10 PER
+//  SIGNAL), AND ANY RECEIVER BEYOND THE LONGEST POSSIBLE RANGE IS REJECTED FIRST.
+//  THE FIRST EXACT_BUCKETS OF THE TABLE SPAN TOO WIDE A RANGE OF log(d) TO BE
+//  USEFUL, SO THE FEW RECEIVERS THAT CLOSE HAVE THEIR LOSS COMPUTED EXACTLY.
+//
+//	var pathloss_exponent	= n [2.0, the same as free space]
+//	var pathloss_d0		= d0 in metres [1.0]
+//	var shadowing		= standard deviation of shadowing in dB [0]
+
+#define	TABLE_SIZE		4096
+#define	EXACT_BUCKETS		64	// beyond these, a bucket is off by < 0.04n dB
+#define	NDEVIATES		1024
+#define	SHADOWING_MARGIN	3.0	// max. range allows shadowing this many deviations in our favour
+
+typedef struct {
+    bool		built;
+    double		max_range2;	// squared metres; anything further is too weak
+    double		exponent;
+    double		d0;
+    double		sigma;
+    double		frequency_GHz;	// of the radio the table was built for
+    float		loss_dB[TABLE_SIZE];	// path loss at squared distance (i+0.5) * max_range2/TABLE_SIZE
+    float		deviate[NDEVIATES];	// standard normal deviates, for shadowing
+} PROPAGATION;
+
+static	PROPAGATION	*prop	= NULL;
+
+// -----------------------------------------------------------------------
+
+//  THE LOG-DISTANCE PATH LOSS, IN dB, AT A DISTANCE IN METRES
+//  (JUST FREE-SPACE LOSS, LIKE cnet'S OWN MODEL, IF WE'RE NOT IN USE)
+static double path_loss(double metres, double frequency_GHz)
+{
+    double	free_space	= 92.467 + 20.0*log10(frequency_GHz);	// at 1km
+
+    if(metres < 0.1) {
+        metres	= 0.1;
+    }
+    if(prop == NULL || metres <= prop->d0) {
+        return free_space + 20.0*log10(metres/1000.0);
+    }
+    return free_space + 20.0*log10(prop->d0/1000.0) + 10.0*prop->exponent*log10(metres/prop->d0);
+}
+
+//  THE SAME SHADOWING FOR A PAIR OF NODES WHICHEVER ONE IS TRANSMITTING
+static double shadowing(int a, int b)
+{
+    unsigned int	lo	= a < b ? a : b;
+    unsigned int	hi	= a < b ? b : a;
+
+    return prop->sigma * prop->deviate[(lo * 2654435761u ^ hi * 40503u) % NDEVIATES];
+}
+
+//  THE PATH LOSS AT A SQUARED DISTANCE WITHIN max_range2, FROM THE TABLE UNLESS
+//  IT'S CLOSE ENOUGH THAT THE TABLE'S BUCKET WOULD BE TOO COARSE
+static double table_loss(double d2)
+{
+    int		i	= (int)(d2 * TABLE_SIZE / prop->max_range2);
+
+    if(i < EXACT_BUCKETS) {
+        return path_loss(sqrt(d2), prop->frequency_GHz);
+    }
+    return prop->loss_dB[i];
+}
+
+static WLANRESULT fast_wlan_model(WLANSIGNAL *sig)
+{
+    double	dx	= sig->rx_pos.x - sig->tx_pos.x;
+    double	dy	= sig->rx_pos.y - sig->tx_pos.y;
+    double	d2	= dx*dx + dy*dy;
+
+//  TOO FAR AWAY FOR ANY TRANSMISSION TO REACH?
+    if(d2 >= prop->max_range2) {
+        return WLAN_TOOWEAK;
+    }
+
+//  THE SIGNAL STRENGTH ARRIVING AT THE RECEIVER
+    double	budget	= sig->tx_info->tx_power_dBm - sig->tx_info->tx_cable_loss_dBm +
+			  sig->tx_info->tx_antenna_gain_dBi - table_loss(d2) +
+			  shadowing(sig->tx_n, sig->rx_n) +
+			  sig->rx_info->rx_antenna_gain_dBi - sig->rx_info->rx_cable_loss_dBm;
+
+    sig->rx_strength_dBm	= budget;
+
+//  CAN THE RECEIVER DETECT, AND THEN DECODE, THIS SIGNAL?
+    if(budget < sig->rx_info->rx_sensitivity_dBm) {
+        return WLAN_TOOWEAK;
+    }
+    if(budget - sig->rx_info->rx_sensitivity_dBm < sig->rx_info->rx_signal_to_noise_dBm) {
+        return WLAN_TOONOISY;
+    }
+    return WLAN_RECEIVED;
+}
+
+//  THE PATH LOSS EXPECTED AT A DISTANCE, WITHOUT SHADOWING - FOR TRANSMIT POWER CONTROL
+//  IT'S WHAT THE MODEL IN USE WILL APPLY, SO A FRAME SENT WITH JUST ENOUGH POWER ARRIVES
+double wlan_path_loss(double metres, double frequency_GHz)
+{
+    if(prop != NULL && metres*metres < prop->max_range2) {
+        return table_loss(metres*metres);
+    }
+    return path_loss(metres, frequency_GHz);
+}
+
+//  EVERY NODE CALLS THIS; THE FIRST BUILDS THE SHARED TABLES FROM ITS OWN WLANINFO
+void init_wlan_model(void)
+{
+    char	*which	= CNET_getvar("propagation");
+    WLANINFO	info;
+
+    if(which == NULL || strcmp(which, "fast") != 0) {
+        return;
+    }
+    prop	= CNET_shmem2("w", sizeof(PROPAGATION));
+    if(!prop->built) {
+        CHECK(CNET_get_wlaninfo(1, &info));
+        prop->exponent	= getvar_double("pathloss_exponent", 2.0);
+        prop->d0	= getvar_double("pathloss_d0", 1.0);
+        prop->sigma	= getvar_double("shadowing", 0.0);
+        prop->frequency_GHz	= info.frequency_GHz;
+
+//  THE LONGEST RANGE IS WHERE A FULL-POWER SIGNAL, SHADOWED AS KINDLY AS IS LIKELY,
+//  FADES BELOW THE RECEIVER'S SENSITIVITY - FOUND BY DOUBLING, THEN BISECTION
+        double	budget	= info.tx_power_dBm - info.tx_cable_loss_dBm + info.tx_antenna_gain_dBi +
+			  info.rx_antenna_gain_dBi - info.rx_cable_loss_dBm -
+			  info.rx_sensitivity_dBm + SHADOWING_MARGIN*prop->sigma;
+        double	lo	= 0.1, hi = 1.0;
+
+        while(path_loss(hi, info.frequency_GHz) < budget && hi < 1.0e7) {
+            lo	= hi;
+            hi	*= 2;
+        }
+        for(int b=0 ; b<50 ; ++b) {
+            double	mid	= (lo + hi) / 2;
+
+            if(path_loss(mid, info.frequency_GHz) < budget)
+                lo	= mid;
+            else
+                hi	= mid;
+        }
+        prop->max_range2	= hi*hi;
+
+        for(int i=0 ; i<TABLE_SIZE ; ++i) {
+            prop->loss_dB[i]	= path_loss(sqrt((i + 0.5) * prop->max_range2 / TABLE_SIZE),
+					info.frequency_GHz);
+        }
+
+//  BOX-MULLER, FROM A FIXED SEED SO EVERY RUN SHADOWS THE SAME WAY
+        CnetRandom	mt	= CNET_newrand(NDEVIATES);
+        for(int i=0 ; i<NDEVIATES ; ++i) {
+            double	u1	= 1.0 - (CNET_nextrand(mt) % 1000000) / 1000000.0;
+            double	u2	= (CNET_nextrand(mt) % 1000000) / 1000000.0;
+
+            prop->deviate[i]	= sqrt(-2.0*log(u1)) * cos(2*M_PI*u2);
+        }
+        prop->built	= true;
+    }
+    CHECK(CNET_set_wlan_model(fast_wlan_model));
+}